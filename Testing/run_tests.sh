@@ -0,0 +1,39 @@
+#!/bin/sh
+# Builds easylang with AddressSanitizer and UBSan, then runs every script in
+# Testing/ that has expected output in Testing/expected/ on both engines, with
+# and without -O.  stdout must match NAME.out, and stderr NAME.err (or be
+# empty when there is none), so a value that was moved where it should have
+# been copied fails here even when the sanitizers stay quiet.  NAME.flags,
+# if present, holds extra options for that script, such as --max-depth.
+#
+#   sh Testing/run_tests.sh
+set -u
+dir=$(cd "$(dirname "$0")" && pwd)
+bin=${TMPDIR:-/tmp}/easylang_test.$$
+${CC:-cc} -std=c99 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=undefined \
+    -o "$bin" "$dir/../easylang.c" -lm || exit 1
+
+runs=0
+failed=0
+for out in "$dir"/expected/*.out; do
+    name=$(basename "$out" .out)
+    err="$dir/expected/$name.err"
+    [ -f "$err" ] || err=/dev/null
+    extra=
+    [ -f "$dir/expected/$name.flags" ] && extra=$(cat "$dir/expected/$name.flags")
+    for flags in "" "-O" "--engine=vm" "--engine=vm -O"; do
+        runs=$((runs + 1))
+        # $flags is split into separate arguments on purpose
+        "$bin" $flags $extra "$dir/$name.elang" < /dev/null > "$bin.out" 2> "$bin.err"
+        if ! cmp -s "$out" "$bin.out" || ! cmp -s "$err" "$bin.err"; then
+            failed=$((failed + 1))
+            echo "FAIL: $name.elang $flags $extra"
+            diff "$out" "$bin.out" | head -n 10
+            diff "$err" "$bin.err" | head -n 10
+        fi
+    done
+done
+
+rm -f "$bin" "$bin.out" "$bin.err"
+echo "$((runs - failed)) of $runs runs passed"
+[ "$failed" -eq 0 ]
@@ -1,7 +1,8 @@
 /* easylang.c
    Enhanced EasyLang interpreter with FOR loop + STEP (C99)
    Build: gcc -std=c99 -O2 -lm -o easylang easylang.c
-   Run: ./easylang program.elang
+   Run: ./easylang [--engine=ast|vm] program.elang
+        (ast: tree-walking evaluator, the default; vm: register bytecode VM)
 */
 
 #include <stdio.h>
@@ -9,6 +10,9 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 
 /* ---------- Lexical tokens ---------- */
 typedef enum {
@@ -28,7 +32,7 @@ typedef enum {
     T_PLUS, T_MINUS, T_MUL, T_DIV, T_MOD,
     T_LPAREN, T_RPAREN,
     T_EQ, T_NEQ, T_GT, T_LT, T_LE, T_GE,
-    T_AND,
+    T_AND, T_OR, T_NOT,
     T_DOT,      // .
     T_NEWLINE,  // line breaks
     T_FUNCTION, // function
@@ -36,14 +40,110 @@ typedef enum {
     T_LBRACE,   // {
     T_RBRACE,   // }
     T_FOR,      // for
+    T_BREAK,    // break
+    T_CONTINUE, // continue
+    T_MATCH,    // match
+    T_CASE,     // case
     T_FROM,     // from
     T_COMMA,    // ,
     T_UNKNOWN
 } TokenType;
 
+/* ---------- Symbols ---------- */
+/* Every identifier is interned once, lowercased, so names compare by
+   pointer from the lexer through to both evaluators. */
+typedef struct Symbol {
+    char *name;
+    size_t len;
+    uint32_t hash;
+    int id;     // dense index into symtab.by_id
+    int slot;   // resolver/compiler scratch: slot of the local, or -1
+    struct FuncDef *func;   // function defined under this name, or NULL
+} Symbol;
+
+static struct {
+    Symbol **buckets;   // open addressing, power-of-two capacity
+    int cap;
+    Symbol **by_id;
+    int count, by_id_cap;
+} symtab;
+
+static Symbol *sym_else, *sym_step, *sym_memo; // identifiers the parser treats as keywords
+
+static uint32_t sym_hash_lower(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)tolower((unsigned char)s[i])) * 16777619u;
+    return h;
+}
+
+static int sym_matches(const Symbol *sym, const char *s, size_t len) {
+    if (sym->len != len) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (sym->name[i] != (char)tolower((unsigned char)s[i])) return 0;
+    }
+    return 1;
+}
+
+static void symtab_grow(void) {
+    int cap = symtab.cap ? symtab.cap * 2 : 1024;
+    Symbol **b = calloc(cap, sizeof(Symbol*));
+    if (!b) { fprintf(stderr, "out of memory\n"); exit(1); }
+    for (int i = 0; i < symtab.cap; i++) {
+        Symbol *sym = symtab.buckets[i];
+        if (!sym) continue;
+        uint32_t j = sym->hash & (cap - 1);
+        while (b[j]) j = (j + 1) & (cap - 1);
+        b[j] = sym;
+    }
+    free(symtab.buckets);
+    symtab.buckets = b;
+    symtab.cap = cap;
+}
+
+/* Returns the symbol for s[0..len), matched case-insensitively. */
+static Symbol *intern(const char *s, size_t len) {
+    if ((symtab.count + 1) * 2 > symtab.cap) symtab_grow();
+    uint32_t h = sym_hash_lower(s, len);
+    uint32_t j = h & (symtab.cap - 1);
+    for (Symbol *sym; (sym = symtab.buckets[j]); j = (j + 1) & (symtab.cap - 1)) {
+        if (sym->hash == h && sym_matches(sym, s, len)) return sym;
+    }
+    Symbol *sym = malloc(sizeof(Symbol));
+    sym->name = malloc(len + 1);
+    if (!sym || !sym->name) { fprintf(stderr, "out of memory\n"); exit(1); }
+    for (size_t i = 0; i < len; i++) sym->name[i] = (char)tolower((unsigned char)s[i]);
+    sym->name[len] = '\0';
+    sym->len = len;
+    sym->hash = h;
+    sym->slot = -1;
+    sym->func = NULL;
+    if (symtab.count == symtab.by_id_cap) {
+        symtab.by_id_cap = symtab.by_id_cap ? symtab.by_id_cap * 2 : 1024;
+        symtab.by_id = realloc(symtab.by_id, symtab.by_id_cap * sizeof(Symbol*));
+        if (!symtab.by_id) { fprintf(stderr, "out of memory\n"); exit(1); }
+    }
+    sym->id = symtab.count;
+    symtab.by_id[symtab.count++] = sym;
+    symtab.buckets[j] = sym;
+    return sym;
+}
+
+static void symtab_free(void) {
+    for (int i = 0; i < symtab.count; i++) {
+        free(symtab.by_id[i]->name);
+        free(symtab.by_id[i]);
+    }
+    free(symtab.by_id);
+    free(symtab.buckets);
+}
+
 typedef struct {
     TokenType type;
-    char *text; // for identifiers/strings/numbers
+    /* Text of identifiers/strings/numbers, as a span of Lexer.src; lexing
+       never copies it.  Identifier spans keep the source's letter case. */
+    size_t start;
+    size_t len;
+    Symbol *sym; // interned identifier
 } Token;
 
 typedef struct {
@@ -69,22 +169,80 @@ static void skip_spaces(Lexer *lx) {
     }
 }
 
-static char *substr_alloc(const char *s, size_t a, size_t b) {
-    size_t len = (b > a) ? b - a : 0;
-    char *r = malloc(len + 1);
-    if (!r) { fprintf(stderr, "out of memory\n"); exit(1); }
-    memcpy(r, s + a, len);
-    r[len] = '\0';
-    return r;
-}
-
-static Token make_token(TokenType t, const char *txt) {
+static Token make_token(TokenType t, size_t start, size_t len) {
     Token tk;
     tk.type = t;
-    tk.text = txt ? strdup(txt) : NULL;
+    tk.start = start;
+    tk.len = len;
+    tk.sym = NULL;
     return tk;
 }
 
+/* Case-insensitive match of a source span against a lowercase word. */
+static int span_is(const char *s, size_t len, const char *word) {
+    for (size_t i = 0; i < len; i++) {
+        if (word[i] == '\0' || tolower((unsigned char)s[i]) != word[i]) return 0;
+    }
+    return word[len] == '\0';
+}
+
+/* Keyword classification: the length and first letter leave at most one
+   candidate, so an ordinary identifier costs one switch and usually no
+   comparison.  "else" and "step" stay identifiers. */
+static TokenType keyword_type(const char *s, size_t len) {
+    const char *kw;
+    TokenType t;
+    switch (len) {
+        case 2:
+            switch (tolower((unsigned char)s[0])) {
+                case 'i': kw = "if"; t = T_IF; break;
+                case 'd': kw = "do"; t = T_DO; break;
+                case 't': kw = "to"; t = T_TO; break;
+                case 'o': kw = "or"; t = T_OR; break;
+                default: return T_IDENTIFIER;
+            }
+            break;
+        case 3:
+            switch (tolower((unsigned char)s[0])) {
+                case 's': kw = "set"; t = T_SET; break;
+                case 'e': kw = "end"; t = T_END; break;
+                case 'a': kw = "and"; t = T_AND; break;
+                case 'f': kw = "for"; t = T_FOR; break;
+                case 'n': kw = "not"; t = T_NOT; break;
+                default: return T_IDENTIFIER;
+            }
+            break;
+        case 4:
+            switch (tolower((unsigned char)s[0])) {
+                case 'r': kw = "read"; t = T_READ; break;
+                case 't': kw = "then"; t = T_THEN; break;
+                case 'f': kw = "from"; t = T_FROM; break;
+                case 'c': kw = "case"; t = T_CASE; break;
+                default: return T_IDENTIFIER;
+            }
+            break;
+        case 5:
+            switch (tolower((unsigned char)s[0])) {
+                case 'p': kw = "print"; t = T_PRINT; break;
+                case 'w': kw = "while"; t = T_WHILE; break;
+                case 'b': kw = "break"; t = T_BREAK; break;
+                case 'm': kw = "match"; t = T_MATCH; break;
+                default: return T_IDENTIFIER;
+            }
+            break;
+        case 6: kw = "return"; t = T_RETURN; break;
+        case 8:
+            switch (tolower((unsigned char)s[0])) {
+                case 'f': kw = "function"; t = T_FUNCTION; break;
+                case 'c': kw = "continue"; t = T_CONTINUE; break;
+                default: return T_IDENTIFIER;
+            }
+            break;
+        default: return T_IDENTIFIER;
+    }
+    return span_is(s, len, kw) ? t : T_IDENTIFIER;
+}
+
 /* ---------- Lexer Functions ---------- */
 static Token lex_string(Lexer *lx) {
     getc_l(lx); // skip opening quote
@@ -95,35 +253,28 @@ static Token lex_string(Lexer *lx) {
     }
     size_t end = lx->pos;
     if (peekc(lx) == '"') getc_l(lx);
-    char *s = substr_alloc(lx->src, start, end);
-    Token t = make_token(T_STRING, s);
-    free(s);
-    return t;
+    return make_token(T_STRING, start, end - start);
 }
 
 static Token lex_ident_or_number(Lexer *lx) {
     size_t start = lx->pos;
+    int numeric = 1;
+    int dots = 0;
     while (1) {
         char c = peekc(lx);
-        if (isalnum((unsigned char)c) || c=='_') { getc_l(lx); continue; }
-        if (c=='.') { getc_l(lx); continue; }
+        if (isalnum((unsigned char)c) || c=='_') {
+            if (!isdigit((unsigned char)c)) numeric = 0;
+            getc_l(lx);
+            continue;
+        }
+        /* a dot belongs to the token only inside it; a trailing one ends the statement */
+        char after = lx->src[lx->pos + (c != '\0')];
+        if (c=='.' && (isalnum((unsigned char)after) || after=='_')) {
+            dots++; if (dots>1) numeric=0; getc_l(lx); continue;
+        }
         break;
     }
-    size_t end = lx->pos;
-    char *s = substr_alloc(lx->src, start, end);
-    int numeric = 1;
-    int dots = 0;
-    for (size_t i=0; i<strlen(s); ++i) {
-        if (s[i]=='.') { dots++; if (dots>1) numeric=0; continue; }
-        if (!isdigit((unsigned char)s[i]) && s[i] != '.') numeric=0;
-    }
-    if (numeric) { Token t = make_token(T_NUMBER, s); free(s); return t; }
-    else {
-        for (char *p=s; *p; ++p) *p = (char)tolower((unsigned char)*p);
-        Token t = make_token(T_IDENTIFIER, s);
-        free(s);
-        return t;
-    }
+    return make_token(numeric ? T_NUMBER : T_IDENTIFIER, start, lx->pos - start);
 }
 
 static Token next_token(Lexer *lx) {
@@ -133,11 +284,11 @@ static Token next_token(Lexer *lx) {
         if (c == '\r') {
             getc_l(lx);
             if (peekc(lx) == '\n') getc_l(lx);
-            return make_token(T_NEWLINE, NULL);
+            return make_token(T_NEWLINE, 0, 0);
         }
         if (c == '\n') {
             getc_l(lx);
-            return make_token(T_NEWLINE, NULL);
+            return make_token(T_NEWLINE, 0, 0);
         }
         if (c == '#') {
             while (peekc(lx) != '\0' && getc_l(lx) != '\n') {}
@@ -147,233 +298,656 @@ static Token next_token(Lexer *lx) {
     }
 
     c = peekc(lx);
-    if (c == '\0') return make_token(T_EOF, NULL);
+    if (c == '\0') return make_token(T_EOF, 0, 0);
     if (c == '"') return lex_string(lx);
-    if (isalpha((unsigned char)c) || c=='_') {
+    if (isalnum((unsigned char)c) || c=='_' || (c=='.' && isdigit((unsigned char)lx->src[lx->pos + 1]))) {
+        /* a name may start with a digit (1x); every name is interned */
         Token t = lex_ident_or_number(lx);
-        if (t.type == T_IDENTIFIER && t.text) {
-            if (strcmp(t.text, "set") == 0) { free(t.text); return make_token(T_SET, NULL); }
-            if (strcmp(t.text, "print") == 0) { free(t.text); return make_token(T_PRINT, NULL); }
-            if (strcmp(t.text, "read") == 0) { free(t.text); return make_token(T_READ, NULL); }
-            if (strcmp(t.text, "if") == 0) { free(t.text); return make_token(T_IF, NULL); }
-            if (strcmp(t.text, "then") == 0) { free(t.text); return make_token(T_THEN, NULL); }
-            if (strcmp(t.text, "end") == 0) { free(t.text); return make_token(T_END, NULL); }
-            if (strcmp(t.text, "while") == 0) { free(t.text); return make_token(T_WHILE, NULL); }
-            if (strcmp(t.text, "do") == 0) { free(t.text); return make_token(T_DO, NULL); }
-            if (strcmp(t.text, "to") == 0) { free(t.text); return make_token(T_TO, NULL); }
-            if (strcmp(t.text, "and") == 0) { free(t.text); return make_token(T_AND, NULL); }
-            if (strcmp(t.text, "function") == 0) { free(t.text); return make_token(T_FUNCTION, NULL); }
-            if (strcmp(t.text, "return") == 0) { free(t.text); return make_token(T_RETURN, NULL); }
-            if (strcmp(t.text, "for") == 0) { free(t.text); return make_token(T_FOR, NULL); }
-            if (strcmp(t.text, "from") == 0) { free(t.text); return make_token(T_FROM, NULL); }
-            if (strcmp(t.text, "step") == 0) { free(t.text); return make_token(T_IDENTIFIER, "step"); }
+        if (t.type == T_IDENTIFIER) {
+            TokenType kw = keyword_type(lx->src + t.start, t.len);
+            if (kw != T_IDENTIFIER) return make_token(kw, 0, 0);
+            t.sym = intern(lx->src + t.start, t.len);
         }
         return t;
     }
-    if (isdigit((unsigned char)c) || c=='.') return lex_ident_or_number(lx);
-    if (c == '.') { getc_l(lx); return make_token(T_DOT, NULL); }
-    if (c == '(') { getc_l(lx); return make_token(T_LPAREN, NULL); }
-    if (c == ')') { getc_l(lx); return make_token(T_RPAREN, NULL); }
-    if (c == '{') { getc_l(lx); return make_token(T_LBRACE, NULL); }
-    if (c == '}') { getc_l(lx); return make_token(T_RBRACE, NULL); }
-    if (c == ',') { getc_l(lx); return make_token(T_COMMA, NULL); }
-    if (c == '+') { getc_l(lx); return make_token(T_PLUS, NULL); }
-    if (c == '-') { getc_l(lx); return make_token(T_MINUS, NULL); }
-    if (c == '*') { getc_l(lx); return make_token(T_MUL, NULL); }
-    if (c == '/') { getc_l(lx); return make_token(T_DIV, NULL); }
-    if (c == '%') { getc_l(lx); return make_token(T_MOD, NULL); }
+    if (c == '.') { getc_l(lx); return make_token(T_DOT, 0, 0); }
+    if (c == '(') { getc_l(lx); return make_token(T_LPAREN, 0, 0); }
+    if (c == ')') { getc_l(lx); return make_token(T_RPAREN, 0, 0); }
+    if (c == '{') { getc_l(lx); return make_token(T_LBRACE, 0, 0); }
+    if (c == '}') { getc_l(lx); return make_token(T_RBRACE, 0, 0); }
+    if (c == ',') { getc_l(lx); return make_token(T_COMMA, 0, 0); }
+    if (c == '+') { getc_l(lx); return make_token(T_PLUS, 0, 0); }
+    if (c == '-') { getc_l(lx); return make_token(T_MINUS, 0, 0); }
+    if (c == '*') { getc_l(lx); return make_token(T_MUL, 0, 0); }
+    if (c == '/') { getc_l(lx); return make_token(T_DIV, 0, 0); }
+    if (c == '%') { getc_l(lx); return make_token(T_MOD, 0, 0); }
     if (c == '<') {
         getc_l(lx);
-        if (peekc(lx) == '=') { getc_l(lx); return make_token(T_LE, NULL); }
-        return make_token(T_LT, NULL);
+        if (peekc(lx) == '=') { getc_l(lx); return make_token(T_LE, 0, 0); }
+        return make_token(T_LT, 0, 0);
     }
     if (c == '>') {
         getc_l(lx);
-        if (peekc(lx) == '=') { getc_l(lx); return make_token(T_GE, NULL); }
-        return make_token(T_GT, NULL);
+        if (peekc(lx) == '=') { getc_l(lx); return make_token(T_GE, 0, 0); }
+        return make_token(T_GT, 0, 0);
     }
     if (c == '=') {
         getc_l(lx);
-        if (peekc(lx) == '=') { getc_l(lx); return make_token(T_EQ, NULL); }
-        lx->pos--; getc_l(lx); return make_token(T_UNKNOWN, NULL);
+        if (peekc(lx) == '=') { getc_l(lx); return make_token(T_EQ, 0, 0); }
+        lx->pos--; getc_l(lx); return make_token(T_UNKNOWN, 0, 0);
     }
     if (c == '!') {
         getc_l(lx);
-        if (peekc(lx) == '=') { getc_l(lx); return make_token(T_NEQ, NULL); }
-        lx->pos--; getc_l(lx); return make_token(T_UNKNOWN, NULL);
+        if (peekc(lx) == '=') { getc_l(lx); return make_token(T_NEQ, 0, 0); }
+        lx->pos--; getc_l(lx); return make_token(T_UNKNOWN, 0, 0);
     }
     getc_l(lx);
-    return make_token(T_UNKNOWN, NULL);
+    return make_token(T_UNKNOWN, 0, 0);
 }
 
 /* ---------- AST and Parser ---------- */
-typedef enum { VAL_NUM, VAL_STR, VAL_NONE } ValueType;
-typedef struct { ValueType type; double num; char *str; } Value;
+/* Strings are immutable and reference counted, so copying a Value that
+   holds one is an increment.  Literals live in the parse arena and their
+   node keeps a reference for the whole run, so they are never freed.  The
+   one exception to immutability is str_append: a string only its variable
+   references may grow in place into spare capacity. */
+typedef struct Str {
+    uint32_t refs;
+    uint32_t len, cap;
+    char chars[];       // NUL-terminated
+} Str;
+
+/* A Value is one NaN-boxed 64-bit word.  Every double except the quiet NaNs
+   with bit 50 set is a number stored as is; arithmetic only ever produces
+   NaNs without that bit, and read_value canonicalizes the NaNs it parses.
+   Strings sit under the sign bit: up to STR_INLINE_MAX bytes are stored in
+   the low 48 bits themselves (NUL-padded, bit 49 set), longer ones as a
+   Str pointer.  NONE and UNSET (a frame slot or VM register that holds no
+   binding yet) are two fixed payloads. */
+typedef struct { uint64_t bits; } Value;
+
+#define NANBOX_QNAN  0x7ffc000000000000ULL
+#define NANBOX_STR   (0x8000000000000000ULL | NANBOX_QNAN)
+#define NANBOX_SHORT (1ULL << 49)
+#define STR_INLINE_MAX 6
+#define NONE_VAL     ((Value){NANBOX_QNAN | 1})
+#define UNSET_VAL    ((Value){NANBOX_QNAN | 2})
+
+static inline Value num_val(double d) { Value v; memcpy(&v.bits, &d, sizeof d); return v; }
+static inline Value str_val(Str *s) { return (Value){NANBOX_STR | (uint64_t)(uintptr_t)s}; }
+static inline int is_num(Value v) { return (v.bits & NANBOX_QNAN) != NANBOX_QNAN; }
+static inline int is_str(Value v) { return (v.bits & NANBOX_STR) == NANBOX_STR; }
+static inline int is_heap_str(Value v) { return (v.bits & (NANBOX_STR | NANBOX_SHORT)) == NANBOX_STR; }
+static inline int is_unset(Value v) { return v.bits == UNSET_VAL.bits; }
+static inline double val_num(Value v) { double d; memcpy(&d, &v.bits, sizeof d); return d; }
+static inline Str *val_str(Value v) { return (Str *)(uintptr_t)(v.bits & ~NANBOX_STR); }
+
+static struct { size_t heap, inlined; } str_stats;   // strings made at run time, for --mem-report
+
+/* A new string of len bytes with one reference; the caller fills chars. */
+static Str *str_alloc(size_t len) {
+    if (len > UINT32_MAX) { fprintf(stderr, "Error: String too long\n"); exit(1); }
+    str_stats.heap++;
+    Str *s = malloc(sizeof(Str) + len + 1);
+    if (!s) { fprintf(stderr, "out of memory\n"); exit(1); }
+    s->refs = 1;
+    s->len = s->cap = (uint32_t)len;
+    s->chars[len] = '\0';
+    return s;
+}
+
+static Str *str_new(const char *chars, size_t len) {
+    Str *s = str_alloc(len);
+    memcpy(s->chars, chars, len);
+    return s;
+}
+
+static void str_release(Str *s) {
+    if (--s->refs == 0) free(s);
+}
+
+static Value str_inline(const char *chars, size_t len) {
+    uint64_t bits = NANBOX_STR | NANBOX_SHORT;
+    for (size_t i = 0; i < len; i++) bits |= (uint64_t)(unsigned char)chars[i] << (8 * i);
+    return (Value){bits};
+}
+
+/* A string value holding a copy of chars, allocating only past STR_INLINE_MAX. */
+static Value str_make(const char *chars, size_t len) {
+    if (len > STR_INLINE_MAX) return str_val(str_new(chars, len));
+    str_stats.inlined++;
+    return str_inline(chars, len);
+}
+
+/* The characters of string v, NUL-terminated; inline ones are unpacked into buf. */
+static const char *str_chars(const Value *v, char buf[STR_INLINE_MAX + 1], size_t *len) {
+    if (is_heap_str(*v)) { *len = val_str(*v)->len; return val_str(*v)->chars; }
+    size_t n = 0;
+    while (n < STR_INLINE_MAX && (buf[n] = (char)(v->bits >> (8 * n))) != '\0') n++;
+    buf[n] = '\0';
+    *len = n;
+    return buf;
+}
 
 typedef enum {
     N_STMT_LIST, N_STMT_SET, N_STMT_PRINT, N_STMT_READ, N_STMT_IF, N_STMT_WHILE,
     N_STMT_FUNCDEF, N_STMT_RETURN,
-    N_STMT_FOR,
+    N_STMT_FOR, N_STMT_BREAK, N_STMT_CONTINUE, N_STMT_MATCH, N_STMT_SET_ARG,
     N_EXPR_BINARY, N_EXPR_NUMBER, N_EXPR_STRING,
-    N_EXPR_VAR, N_EXPR_CALL
+    N_EXPR_VAR, N_EXPR_CALL,
+    N_EXPR_AND, N_EXPR_OR, N_EXPR_NOT,
+    N_EXPR_CACHED, N_EXPR_IV, N_EXPR_INLINE, N_EXPR_ARG
 } NodeType;
 
+/* Binary operators, in the order of their OP_ADD..OP_GE opcodes. */
+typedef enum {
+    BIN_ADD, BIN_SUB, BIN_MUL, BIN_DIV, BIN_MOD,
+    BIN_EQ, BIN_NEQ, BIN_LT, BIN_LE, BIN_GT, BIN_GE
+} BinOp;
+
+/* Each node kind keeps only its own fields in the union, and node_alloc
+   sizes a node to the header plus that member: a number literal takes 24
+   bytes and a binary operator 32 instead of one struct with every field. */
 typedef struct Node {
     NodeType type;
-    char *name; // for identifiers, function names
-    struct Node *left, *right; // for binary ops
-    struct Node *cond, *body, *else_body; // for if/while
-    struct Node *next; // for statement lists
-    double number; // for numbers, token types in binary
-    char *string; // for strings
-    char **params; // for function params
-    int param_count; // number of params
-    struct Node **args; // for function call args
-    int arg_count; // number of args
-    /* for N_STMT_FOR */
-    char *var;          // loop variable name
-    struct Node *from_expr;
-    struct Node *to_expr;
-    struct Node *step_expr;   // optional step (NULL = 1)
+    uint8_t op;                 // BinOp, for N_EXPR_BINARY
+    uint8_t calls;              // the subtree contains a call (set by the resolver)
+    uint8_t tail;               // N_EXPR_CALL: returned by the function it calls (set by the resolver)
+    uint8_t quick;              // N_EXPR_BINARY: the operand types seen so far (Quick, AST engine)
+    struct Node *next;          // for statement lists
+    union {
+        struct Node *list;      // N_STMT_LIST: first statement
+        struct Node *expr;      // N_STMT_PRINT, N_STMT_RETURN (NULL = bare return), N_EXPR_NOT
+        struct { Symbol *name; int slot; } var;  // N_EXPR_VAR, N_STMT_READ; slot -1 = not local
+        double number;          // N_EXPR_NUMBER
+        Value string;           // N_EXPR_STRING: inline, or an arena Str the node holds a reference to
+        struct { struct Node *left, *right; } bin;  // N_EXPR_BINARY, N_EXPR_AND, N_EXPR_OR
+        struct { Symbol *name; struct Node *expr; int slot; } set;
+        struct {
+            Symbol *name; struct Node **args; int arg_count;
+            struct FuncDef *fn;     // linked on the first call
+        } call;
+        struct {
+            struct Node *cond, *body, *else_body;  // N_STMT_IF, N_STMT_WHILE
+            struct Node *cached;                   // N_STMT_WHILE: its N_EXPR_CACHED nodes (-O)
+        } cond;
+        struct {
+            Symbol *var; int slot; struct Node *from, *to, *step, *body;  // step NULL = 1
+            struct Node *cached, *ivs;  // its N_EXPR_CACHED and N_EXPR_IV nodes (-O)
+        } loop;
+        struct {
+            struct Node *expr;          // a loop invariant
+            double value; uint64_t gen; // expr's number, valid while gen == cache_gen
+            int reg;                    // the VM register holding it
+        } cached;
+        struct {
+            struct Node *expr;          // i * c for the loop's i and a literal c
+            double scale, value, delta; // c, the product this iteration, and its step
+            int exact;                  // the product can be kept up by adding delta
+        } iv;
+        struct {
+            struct Node *subject, **bodies, *else_body; int ncases;
+            struct MatchTable *table;   // label -> index into bodies
+        } match;
+        struct {
+            Symbol *name; Symbol **params; int param_count; int memo; struct Node *body;
+            Symbol **locals; int nlocals;   // frame slot names, set by resolve_program
+        } func;
+        struct {
+            Symbol *name; struct Node **args; int arg_count;  // the call it replaces (-O)
+            struct Node *body;          // a copy of the function's body
+            Value *vals; int nvals;     // its locals, arguments first, while the body runs
+            int reg;                    // the VM register of vals[0]
+        } inl;
+        struct { struct Node *inl; int index; Symbol *name; } arg;  // N_EXPR_ARG: a local of an inlined body
+        struct { struct Node *arg, *expr; } set_arg;  // N_STMT_SET_ARG: assigns the N_EXPR_ARG arg
+    } u;
 } Node;
 
+#define NODE_SIZE(member) (offsetof(Node, u) + sizeof(((Node *)0)->u.member))
+static const size_t node_sizes[] = {
+    [N_STMT_LIST] = NODE_SIZE(list),     [N_STMT_SET] = NODE_SIZE(set),
+    [N_STMT_PRINT] = NODE_SIZE(expr),    [N_STMT_READ] = NODE_SIZE(var),
+    [N_STMT_IF] = NODE_SIZE(cond),       [N_STMT_WHILE] = NODE_SIZE(cond),
+    [N_STMT_FUNCDEF] = NODE_SIZE(func),  [N_STMT_RETURN] = NODE_SIZE(expr),
+    [N_STMT_FOR] = NODE_SIZE(loop),      [N_EXPR_BINARY] = NODE_SIZE(bin),
+    [N_STMT_BREAK] = offsetof(Node, u),  [N_STMT_CONTINUE] = offsetof(Node, u),
+    [N_STMT_MATCH] = NODE_SIZE(match),
+    [N_EXPR_NUMBER] = NODE_SIZE(number), [N_EXPR_STRING] = NODE_SIZE(string),
+    [N_EXPR_VAR] = NODE_SIZE(var),       [N_EXPR_CALL] = NODE_SIZE(call),
+    [N_EXPR_AND] = NODE_SIZE(bin),       [N_EXPR_OR] = NODE_SIZE(bin),
+    [N_EXPR_NOT] = NODE_SIZE(expr),      [N_EXPR_CACHED] = NODE_SIZE(cached),
+    [N_EXPR_IV] = NODE_SIZE(iv),         [N_EXPR_INLINE] = NODE_SIZE(inl),
+    [N_EXPR_ARG] = NODE_SIZE(arg),       [N_STMT_SET_ARG] = NODE_SIZE(set_arg),
+};
+
+struct Proto;
+struct Memo;
+
 typedef struct FuncDef {
-    char *name;
-    char **params;
+    Symbol *name;
+    Symbol **params;
     int param_count;
     Node *body;
+    Symbol **locals;     // frame slot names, parameters first
+    int nlocals;
+    struct Proto *proto; // compiled body (VM engine only)
+    struct Memo *memo;   // result cache of a memo function, else NULL
 } FuncDef;
 
-static Node *node_alloc(NodeType t) { Node *n = calloc(1, sizeof(Node)); n->type = t; return n; }
+/* ---------- Arena ---------- */
+/* Everything the parser builds (nodes, string literals, parameter and
+   argument arrays) lives in one arena per program: nodes end up packed in
+   parse order and the whole tree is released in one pass over the blocks. */
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used, cap;
+} ArenaBlock;
 
-/* ---------- Symbol Table and Functions ---------- */
-typedef struct Var {
-    char *name;
-    Value val;
-    struct Var *next;
-} Var;
+typedef struct {
+    ArenaBlock *head;
+    size_t used;                    // bytes handed out, for --mem-report
+} Arena;
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN      sizeof(double)
+
+static void *arena_alloc(Arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    ArenaBlock *b = a->head;
+    if (!b || b->cap - b->used < size) {
+        size_t cap = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        b = malloc(sizeof(ArenaBlock) + cap);
+        if (!b) { fprintf(stderr, "out of memory\n"); exit(1); }
+        b->used = 0;
+        b->cap = cap;
+        b->next = a->head;
+        a->head = b;
+    }
+    void *r = (char *)(b + 1) + b->used;
+    b->used += size;
+    a->used += size;
+    memset(r, 0, size);
+    return r;
+}
+
+/* A string literal's value: inline if short, else an arena Str whose
+   reference the node holds. */
+static Value arena_str(Arena *a, const char *chars, size_t len) {
+    if (len <= STR_INLINE_MAX) return str_inline(chars, len);
+    Str *s = arena_alloc(a, sizeof(Str) + len + 1);
+    s->refs = 1;
+    s->len = s->cap = (uint32_t)len;
+    memcpy(s->chars, chars, len);
+    return str_val(s);
+}
+
+static void arena_free(Arena *a) {
+    while (a->head) {
+        ArenaBlock *next = a->head->next;
+        free(a->head);
+        a->head = next;
+    }
+}
+
+/* Growable arrays outside the arena double their capacity. */
+static void *grow_array(void *arr, int *cap, int need, size_t elem) {
+    if (need <= *cap) return arr;
+    int ncap = *cap ? *cap : 16;
+    while (ncap < need) ncap *= 2;
+    arr = realloc(arr, (size_t)ncap * elem);
+    if (!arr) { fprintf(stderr, "out of memory\n"); exit(1); }
+    *cap = ncap;
+    return arr;
+}
+
+static struct { size_t count, bytes; } node_stats;
 
-typedef struct Scope {
-    Var *vars;
-    struct Scope *parent;
-} Scope;
+static Node *node_alloc(Arena *a, NodeType t) {
+    Node *n = arena_alloc(a, node_sizes[t]);
+    n->type = t;
+    node_stats.count++;
+    node_stats.bytes += node_sizes[t];
+    return n;
+}
+
+/* ---------- Symbol Table and Functions ---------- */
+/* Globals live in a table indexed by Symbol id.  A function activation is a
+   Frame whose slots hold the locals resolve_program assigned it; a name the
+   body reads but never assigns, or reads before assigning, is looked up
+   through the calling frames and then the globals (scoping is dynamic).
+   The slots of all active calls share one growable value stack, so a call
+   allocates nothing once the stack has reached its depth.  Frames sit on a
+   stack of their own, each directly above its caller. */
+typedef struct Frame {
+    const FuncDef *fn;      // fn->locals names the slots
+    int base;               // slot 0 is frame_stack.vals[base]
+    int task;               // tree walker task that made the call
+} Frame;
+
+static struct { Value *vals; int top, cap; } frame_stack;
+static struct { Frame *vals; int top, cap; } call_stack;
+
+#define MAX_DEPTH_DEFAULT 1000000
+static int max_depth = MAX_DEPTH_DEFAULT;   // --max-depth: nested calls allowed
+
+/* Both engines call this before entering a call that would be depth deep. */
+static void check_depth(int depth) {
+    if (depth > max_depth) {
+        fprintf(stderr, "Error: Recursion limit exceeded (max depth %d)\n", max_depth);
+        exit(1);
+    }
+}
 
+/* Functions are found through their name's Symbol, so a lookup costs the
+   same however many are defined; the table only keeps them for cleanup. */
 typedef struct {
     FuncDef **funcs;
-    int func_count;
+    int func_count, func_cap;
 } FuncTable;
 
-static Scope *global_scope = NULL;
-static Scope *current_scope = NULL;
-static FuncTable func_table = {NULL, 0};
-
-static void push_scope() {
-    Scope *s = malloc(sizeof(Scope));
-    s->vars = NULL;
-    s->parent = current_scope;
-    current_scope = s;
-    if (!global_scope) global_scope = s;
-}
-
-static void pop_scope() {
-    if (!current_scope) return;
-    Scope *s = current_scope;
-    Var *v = s->vars;
-    while (v) {
-        Var *next = v->next;
-        if (v->val.type == VAL_STR && v->val.str) free(v->val.str);
-        free(v->name);
-        free(v);
-        v = next;
-    }
-    current_scope = s->parent;
-    free(s);
-}
-
-static Var *var_get(const char *name) {
-    for (Scope *s = current_scope; s; s = s->parent) {
-        for (Var *v = s->vars; v; v = v->next) {
-            if (strcmp(v->name, name) == 0) return v;
-        }
+static struct { Value *vals; int cap; } globals;
+static Frame *current_frame = NULL;   // NULL at top level, else the top of call_stack
+static FuncTable func_table = {NULL, 0, 0};
+
+static Value *global_slot(const Symbol *name) {
+    if (name->id >= globals.cap) {
+        int old = globals.cap;
+        globals.vals = grow_array(globals.vals, &globals.cap, name->id + 1, sizeof(Value));
+        for (int i = old; i < globals.cap; i++) globals.vals[i] = UNSET_VAL;
     }
-    if (current_scope && current_scope != global_scope) {
-        for (Var *v = global_scope->vars; v; v = v->next) {
-            if (strcmp(v->name, name) == 0) return v;
+    return &globals.vals[name->id];
+}
+
+static Frame *frame_caller(const Frame *f) {
+    return f > call_stack.vals ? (Frame *)f - 1 : NULL;
+}
+
+/* The innermost binding of name in frame f, its callers, or the globals. */
+static Value *var_lookup(const Frame *f, const Symbol *name) {
+    for (; f; f = frame_caller(f)) {
+        for (int s = f->fn->nlocals - 1; s >= 0; s--) {
+            if (f->fn->locals[s] != name) continue;
+            Value *v = &frame_stack.vals[f->base + s];
+            if (!is_unset(*v)) return v;
+            break;
         }
     }
+    if (name->id < globals.cap && !is_unset(globals.vals[name->id])) return &globals.vals[name->id];
     return NULL;
 }
+
+/* Ownership.  A Value held in a variable, register, constant or literal node
+   owns one reference to its heap string (inline strings and numbers own
+   nothing).  Functions taking `const Value *` borrow: the pointee stays valid
+   only until the next call that can assign or grow the frame stack.  A Value
+   passed or returned by value is moved: the receiver now owns it and must
+   store it, move it on, or value_free it.  value_dup turns a borrow into an
+   owned copy; it is only needed where the source lives on. */
 static Value value_dup(const Value *v) {
-    Value nv = *v;
-    if (v->type == VAL_STR && v->str) {
-        nv.str = strdup(v->str);
-        if (!nv.str) { perror("strdup"); exit(1); }
-    }
-    return nv;
+    if (is_heap_str(*v)) val_str(*v)->refs++;
+    return *v;
 }
 static void value_free(Value *v) {
-    if (v->type == VAL_STR && v->str) {
-        free(v->str);
-        v->str = NULL;
-    }
-    v->type = VAL_NONE;
-    v->num = 0.0;
+    if (is_heap_str(*v)) str_release(val_str(*v));
+    *v = NONE_VAL;
 }
 
-static void var_set(const char *name, Value val) {
-    Var *v = NULL;
-    if (current_scope) {
-        for (v = current_scope->vars; v; v = v->next) {
-            if (strcmp(v->name, name) == 0) break;
-        }
-    } else {
-        for (v = global_scope->vars; v; v = v->next) {
-            if (strcmp(v->name, name) == 0) break;
-        }
+/* Stores val (taking ownership) into local slot, or into the global
+   name when slot is -1. */
+static void var_set(const Symbol *name, int slot, Value val) {
+    Value *v = slot >= 0 ? &frame_stack.vals[current_frame->base + slot] : global_slot(name);
+    if (is_heap_str(*v)) str_release(val_str(*v));
+    *v = val;
+}
+
+/* Pushes n unset slots and returns the index of the first. */
+static int frame_push(int n) {
+    int base = frame_stack.top;
+    frame_stack.vals = grow_array(frame_stack.vals, &frame_stack.cap, base + n, sizeof(Value));
+    for (int i = base; i < base + n; i++) frame_stack.vals[i] = UNSET_VAL;
+    frame_stack.top = base + n;
+    return base;
+}
+
+static void frame_pop(int base) {
+    for (int i = base; i < frame_stack.top; i++) value_free(&frame_stack.vals[i]);
+    frame_stack.top = base;
+}
+
+/* Also releases whatever the frames still hold after an error, and may be
+   called again. */
+static void globals_free(void) {
+    for (int i = 0; i < globals.cap; i++) {
+        if (is_heap_str(globals.vals[i])) str_release(val_str(globals.vals[i]));
     }
-    
-    if (v) {
-        if (v->val.type == VAL_STR && v->val.str) free(v->val.str);
-        v->val = val;
-        return;
-    }
-    
-    v = malloc(sizeof(Var));
-    v->name = strdup(name);
-    v->val = val;
-    
-    if (current_scope) {
-        v->next = current_scope->vars;
-        current_scope->vars = v;
-    } else {
-        v->next = global_scope->vars;
-        global_scope->vars = v;
+    frame_pop(0);
+    free(globals.vals);
+    free(frame_stack.vals);
+    free(call_stack.vals);
+    globals.vals = NULL; globals.cap = 0;
+    frame_stack.vals = NULL; frame_stack.cap = 0;
+    call_stack.vals = NULL; call_stack.top = call_stack.cap = 0;
+}
+
+static FuncDef *func_get(const Symbol *name) { return name->func; }
+
+static struct Memo *memo_new(int nargs);
+
+static FuncDef *func_set(const Node *def) {
+    Symbol *name = def->u.func.name;
+    if (func_get(name)) { fprintf(stderr, "Error: Function %s already defined\n", name->name); exit(1); }
+    FuncDef *f = malloc(sizeof(FuncDef));
+    f->name = name;
+    f->params = def->u.func.params;
+    f->param_count = def->u.func.param_count;
+    f->body = def->u.func.body;
+    f->locals = def->u.func.locals;
+    f->nlocals = def->u.func.nlocals;
+    f->proto = NULL;
+    f->memo = def->u.func.memo ? memo_new(f->param_count) : NULL;
+    func_table.funcs = grow_array(func_table.funcs, &func_table.func_cap, func_table.func_count + 1, sizeof(FuncDef*));
+    func_table.funcs[func_table.func_count++] = f;
+    name->func = f;
+    return f;
+}
+
+/* ---------- Memoization ---------- */
+/* A `memo function` caches its results keyed on its arguments, compared by
+   value.  The cache is direct-mapped: each key has one slot, and storing a
+   key whose slot is taken evicts the entry there, so a cache never holds
+   more than MEMO_SLOTS results. */
+#define MEMO_SLOTS 4096
+
+typedef struct Memo {
+    int nargs;
+    Value *keys;                     // nargs per slot
+    Value *results;                  // UNSET marks an empty slot
+    size_t hits, misses, evictions;  // for --stats
+} Memo;
+
+static uint32_t value_hash(const Value *v) {
+    uint32_t h = 2166136261u;
+    if (is_str(*v)) {
+        char buf[STR_INLINE_MAX + 1];
+        size_t len;
+        const char *c = str_chars(v, buf, &len);
+        for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)c[i]) * 16777619u;
+        return h;
     }
+    for (int i = 0; i < 64; i += 8) h = (h ^ (uint8_t)(v->bits >> i)) * 16777619u;
+    return h ^ 1;
 }
 
-static FuncDef *func_get(const char *name) {
-    for (int i = 0; i < func_table.func_count; i++) {
-        if (strcmp(func_table.funcs[i]->name, name) == 0) return func_table.funcs[i];
+static int value_same(const Value *a, const Value *b) {
+    if (is_str(*a) && is_str(*b)) {
+        char abuf[STR_INLINE_MAX + 1], bbuf[STR_INLINE_MAX + 1];
+        size_t alen, blen;
+        const char *x = str_chars(a, abuf, &alen), *y = str_chars(b, bbuf, &blen);
+        return alen == blen && memcmp(x, y, alen) == 0;
     }
+    return a->bits == b->bits;
+}
+
+static Memo *memo_new(int nargs) {
+    Memo *m = calloc(1, sizeof(Memo));
+    if (!m) { fprintf(stderr, "out of memory\n"); exit(1); }
+    m->nargs = nargs;
+    m->keys = malloc((size_t)MEMO_SLOTS * (nargs ? nargs : 1) * sizeof(Value));
+    m->results = malloc(MEMO_SLOTS * sizeof(Value));
+    if (!m->keys || !m->results) { fprintf(stderr, "out of memory\n"); exit(1); }
+    for (int s = 0; s < MEMO_SLOTS; s++) m->results[s] = UNSET_VAL;
+    return m;
+}
+
+static uint32_t memo_slot(const Memo *m, const Value *args) {
+    uint32_t h = 0;
+    for (int i = 0; i < m->nargs; i++) h = h * 31 + value_hash(&args[i]);
+    return h & (MEMO_SLOTS - 1);
+}
+
+static int memo_holds(const Memo *m, uint32_t s, const Value *args) {
+    if (is_unset(m->results[s])) return 0;
+    for (int i = 0; i < m->nargs; i++)
+        if (!value_same(&m->keys[s * m->nargs + i], &args[i])) return 0;
+    return 1;
+}
+
+/* The cached result of a call with these arguments, or NULL. */
+static const Value *memo_find(Memo *m, const Value *args) {
+    uint32_t s = memo_slot(m, args);
+    if (memo_holds(m, s, args)) { m->hits++; return &m->results[s]; }
+    m->misses++;
     return NULL;
 }
 
-static void func_set(const char *name, char **params, int param_count, Node *body) {
-    if (func_get(name)) { fprintf(stderr, "Error: Function %s already defined\n", name); exit(1); }
-    FuncDef *f = malloc(sizeof(FuncDef));
-    f->name = strdup(name);
-    f->params = params;
-    f->param_count = param_count;
-    f->body = body;
-    func_table.funcs = realloc(func_table.funcs, (func_table.func_count + 1) * sizeof(FuncDef*));
-    func_table.funcs[func_table.func_count++] = f;
+/* Caches copies of args and result, evicting whatever held their slot. */
+static void memo_store(Memo *m, const Value *args, const Value *result) {
+    uint32_t s = memo_slot(m, args);
+    Value *key = &m->keys[s * m->nargs];
+    if (!is_unset(m->results[s])) {
+        if (!memo_holds(m, s, args)) m->evictions++;
+        value_free(&m->results[s]);
+        for (int i = 0; i < m->nargs; i++) value_free(&key[i]);
+    }
+    for (int i = 0; i < m->nargs; i++) key[i] = value_dup(&args[i]);
+    m->results[s] = value_dup(result);
+}
+
+static void memo_free(Memo *m) {
+    for (int s = 0; s < MEMO_SLOTS; s++) {
+        if (is_unset(m->results[s])) continue;
+        value_free(&m->results[s]);
+        for (int i = 0; i < m->nargs; i++) value_free(&m->keys[s * m->nargs + i]);
+    }
+    free(m->keys);
+    free(m->results);
+    free(m);
+}
+
+/* ---------- Match Tables ---------- */
+/* A match statement dispatches through a table built once by the parser.
+   Integer labels that fill most of their range index an array by value;
+   strings, fractions and sparse integers go in an open-addressing hash
+   table.  Both live in the AST's arena. */
+typedef struct { Value key; int body; } MatchEntry;   // body -1 = empty
+
+typedef struct MatchTable {
+    double lo; int *dense; int ndense;  // dense[v - lo]: body index, -1 = none
+    MatchEntry *hashed; int cap;        // every other label; cap 0 = none
+} MatchTable;
+
+static Value match_key(const Value *v) {
+    return is_num(*v) ? num_val(val_num(*v) + 0.0) : *v;   /* -0 matches 0 */
+}
+
+static int is_int_label(const Value *v) {
+    return is_num(*v) && val_num(*v) == floor(val_num(*v)) && fabs(val_num(*v)) < 1e9;
+}
+
+/* Builds the table for labels[i] -> bodies[i]; returns NULL if a label
+   repeats. */
+static MatchTable *match_build(Arena *a, const Value *labels, const int *bodies, int n) {
+    MatchTable *t = arena_alloc(a, sizeof(MatchTable));
+    double lo = 0, hi = -1;
+    int nint = 0, nhashed = 0;
+    for (int i = 0; i < n; i++) {
+        if (!is_int_label(&labels[i])) continue;
+        double d = val_num(labels[i]);
+        if (nint++ == 0 || d < lo) lo = d;
+        if (nint == 1 || d > hi) hi = d;
+    }
+    int dense = nint > 0 && hi - lo < 2.0 * nint + 8;
+    if (dense) {
+        t->lo = lo;
+        t->ndense = (int)(hi - lo) + 1;
+        t->dense = arena_alloc(a, t->ndense * sizeof(int));
+        for (int i = 0; i < t->ndense; i++) t->dense[i] = -1;
+    }
+    for (int i = 0; i < n; i++) if (!(dense && is_int_label(&labels[i]))) nhashed++;
+    if (nhashed) {
+        for (t->cap = 4; t->cap < 2 * nhashed; t->cap *= 2) {}
+        t->hashed = arena_alloc(a, t->cap * sizeof(MatchEntry));
+        for (int i = 0; i < t->cap; i++) t->hashed[i].body = -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (dense && is_int_label(&labels[i])) {
+            int *d = &t->dense[(int)(val_num(labels[i]) - lo)];
+            if (*d >= 0) return NULL;
+            *d = bodies[i];
+            continue;
+        }
+        Value key = match_key(&labels[i]);
+        uint32_t h = value_hash(&key) & (t->cap - 1);
+        for (; t->hashed[h].body >= 0; h = (h + 1) & (t->cap - 1))
+            if (value_same(&t->hashed[h].key, &key)) return NULL;
+        t->hashed[h].key = key;
+        t->hashed[h].body = bodies[i];
+    }
+    return t;
+}
+
+/* The index of the body whose label equals v, or -1.  Numbers and strings
+   never equal each other. */
+static int match_find(const MatchTable *t, const Value *v) {
+    if (is_num(*v) && t->ndense) {
+        double off = val_num(*v) - t->lo;
+        if (off >= 0 && off < t->ndense && off == (int)off) return t->dense[(int)off];
+    }
+    if (!t->cap || !(is_num(*v) || is_str(*v))) return -1;
+    Value key = match_key(v);
+    for (uint32_t h = value_hash(&key) & (t->cap - 1); t->hashed[h].body >= 0; h = (h + 1) & (t->cap - 1))
+        if (value_same(&t->hashed[h].key, &key)) return t->hashed[h].body;
+    return -1;
 }
 
 /* ---------- Parser Functions ---------- */
-typedef struct { Lexer lx; Token cur; } Parser;
-static void token_free(Token *t) { if (!t) return; if (t->text) free(t->text); t->text = NULL; }
+typedef struct {
+    Lexer lx;
+    Token cur;
+    Arena *arena;
+    void **scratch; int nscratch, scratch_cap; // params/args being collected
+    int loops;                                 // loops around the current statement, within its function
+} Parser;
 static Token peek_token(Parser *p) { return p->cur; }
-static void advance(Parser *p) { token_free(&p->cur); p->cur = next_token(&p->lx); }
+static void advance(Parser *p) { p->cur = next_token(&p->lx); }
+static Token peek_next(Parser *p) { Lexer lx = p->lx; return next_token(&lx); } // the token after cur
+static int has_text(Token t) { return t.type == T_IDENTIFIER || t.type == T_NUMBER || t.type == T_STRING; }
+static double token_number(Parser *p, Token t) {
+    return strtod(p->lx.src + t.start, NULL); // the span ends at a non-numeric character
+}
+/* Arena copy of a token's text; identifiers are case-insensitive and come out lowercased. */
+static Value token_str(Parser *p, Token t) {
+    return arena_str(p->arena, p->lx.src + t.start, t.len);
+}
+
+static char *token_strdup(Parser *p, Token t) {
+    char *r = arena_alloc(p->arena, t.len + 1);
+    memcpy(r, p->lx.src + t.start, t.len);
+    r[t.len] = '\0';
+    if (t.type == T_IDENTIFIER) for (char *c = r; *c; ++c) *c = (char)tolower((unsigned char)*c);
+    return r;
+}
 static int accept(Parser *p, TokenType t) { if (peek_token(p).type == t) { advance(p); return 1; } return 0; }
 static void expect(Parser *p, TokenType t, const char *msg) {
     if (peek_token(p).type == t) { advance(p); return; }
@@ -381,18 +955,31 @@ static void expect(Parser *p, TokenType t, const char *msg) {
     exit(1);
 }
 
+/* Parameter and argument lists nest (f(g(x))), so they are gathered on a
+   scratch stack and copied into the arena once their length is known. */
+static void scratch_push(Parser *p, void *item) {
+    if (p->nscratch == p->scratch_cap) {
+        p->scratch_cap = p->scratch_cap ? p->scratch_cap * 2 : 64;
+        p->scratch = realloc(p->scratch, p->scratch_cap * sizeof(void*));
+        if (!p->scratch) { fprintf(stderr, "out of memory\n"); exit(1); }
+    }
+    p->scratch[p->nscratch++] = item;
+}
+
 static void expect_stmt_terminator(Parser *p) {
     Token t = peek_token(p);
     if (t.type == T_DOT || t.type == T_NEWLINE) {
         advance(p);
     } else if (t.type == T_SET || t.type == T_PRINT || t.type == T_READ || t.type == T_IF || 
               t.type == T_WHILE || t.type == T_END || t.type == T_EOF || t.type == T_FUNCTION || 
-              t.type == T_RETURN || t.type == T_RBRACE ||
-              (t.type == T_IDENTIFIER && t.text && strcmp(t.text, "else") == 0)) {
+              t.type == T_RETURN || t.type == T_RBRACE || t.type == T_CASE ||
+              t.type == T_FOR || t.type == T_MATCH || t.type == T_BREAK || t.type == T_CONTINUE ||
+              t.sym == sym_else) {
         // Implicit termination
     } else {
+        char *text = has_text(t) ? token_strdup(p, t) : NULL;
         fprintf(stderr, "Parse error at line %d: expected '.' or newline but found token %d ('%s')\n",
-                p->lx.line, t.type, t.text ? t.text : "");
+                p->lx.line, t.type, text ? text : "");
         exit(1);
     }
 }
@@ -410,34 +997,40 @@ static Node *parse_func_def(Parser *p) {
         fprintf(stderr, "Parse error at line %d: expected identifier after 'function'\n", p->lx.line);
         exit(1);
     }
-    char *name = strdup(peek_token(p).text);
+    Symbol *name = peek_token(p).sym;
     advance(p);
     expect(p, T_LPAREN, "(");
-    char **params = NULL;
+    Symbol **params = NULL;
     int param_count = 0;
     if (peek_token(p).type != T_RPAREN) {
-        params = malloc(16 * sizeof(char*));
-        params[param_count++] = strdup(peek_token(p).text);
-        advance(p);
-        while (peek_token(p).type == T_COMMA) {
-            advance(p);
+        int base = p->nscratch;
+        while (1) {
             if (peek_token(p).type != T_IDENTIFIER) {
                 fprintf(stderr, "Parse error at line %d: expected parameter name\n", p->lx.line);
                 exit(1);
             }
-            params[param_count++] = strdup(peek_token(p).text);
+            scratch_push(p, peek_token(p).sym);
+            advance(p);
+            if (peek_token(p).type != T_COMMA) break;
             advance(p);
         }
+        param_count = p->nscratch - base;
+        params = arena_alloc(p->arena, param_count * sizeof(Symbol*));
+        for (int i = 0; i < param_count; i++) params[i] = p->scratch[base + i];
+        p->nscratch = base;
     }
     expect(p, T_RPAREN, ")");
     expect(p, T_LBRACE, "{");
+    int loops = p->loops;
+    p->loops = 0;   /* break and continue cannot leave a function */
     Node *body = parse_statements(p);
+    p->loops = loops;
     expect(p, T_RBRACE, "}");
-    Node *n = node_alloc(N_STMT_FUNCDEF);
-    n->name = name;
-    n->params = params;
-    n->param_count = param_count;
-    n->body = body;
+    Node *n = node_alloc(p->arena, N_STMT_FUNCDEF);
+    n->u.func.name = name;
+    n->u.func.params = params;
+    n->u.func.param_count = param_count;
+    n->u.func.body = body;
     return n;
 }
 
@@ -446,8 +1039,8 @@ static Node *parse_return_stmt(Parser *p) {
     Node *expr = (peek_token(p).type == T_DOT || peek_token(p).type == T_NEWLINE || 
                   peek_token(p).type == T_RBRACE) ? NULL : parse_expression(p);
     expect_stmt_terminator(p);
-    Node *n = node_alloc(N_STMT_RETURN);
-    n->body = expr;
+    Node *n = node_alloc(p->arena, N_STMT_RETURN);
+    n->u.expr = expr;
     return n;
 }
 
@@ -458,7 +1051,7 @@ static Node *parse_for_stmt(Parser *p) {
         fprintf(stderr, "Parse error at line %d: expected identifier after 'for'\n", p->lx.line);
         exit(1);
     }
-    char *var = strdup(peek_token(p).text);
+    Symbol *var = peek_token(p).sym;
     advance(p);
 
     expect(p, T_FROM, "from");
@@ -469,76 +1062,104 @@ static Node *parse_for_stmt(Parser *p) {
 
     /* Optional STEP */
     Node *step = NULL;
-    if (peek_token(p).type == T_IDENTIFIER && strcmp(peek_token(p).text, "step") == 0) {
+    if (peek_token(p).sym == sym_step) {
         advance(p);  // consume "step"
         step = parse_expression(p);
     }
 
     expect(p, T_LBRACE, "{");
+    p->loops++;
     Node *body = parse_statements(p);
+    p->loops--;
     expect(p, T_RBRACE, "}");
 
-    Node *n = node_alloc(N_STMT_FOR);
-    n->var       = var;
-    n->from_expr = from;
-    n->to_expr   = to;
-    n->step_expr = step;
-    n->body      = body;
+    Node *n = node_alloc(p->arena, N_STMT_FOR);
+    n->u.loop.var  = var;
+    n->u.loop.from = from;
+    n->u.loop.to   = to;
+    n->u.loop.step = step;
+    n->u.loop.body = body;
+    return n;
+}
+
+static BinOp binop_of(TokenType t) {
+    switch (t) {
+        case T_PLUS: return BIN_ADD;
+        case T_MINUS: return BIN_SUB;
+        case T_MUL: return BIN_MUL;
+        case T_DIV: return BIN_DIV;
+        case T_MOD: return BIN_MOD;
+        case T_EQ: return BIN_EQ;
+        case T_NEQ: return BIN_NEQ;
+        case T_LT: return BIN_LT;
+        case T_LE: return BIN_LE;
+        case T_GT: return BIN_GT;
+        case T_GE: return BIN_GE;
+        default: return BIN_ADD;
+    }
+}
+
+static Node *binary_node(Parser *p, BinOp op, Node *left, Node *right) {
+    Node *n = node_alloc(p->arena, N_EXPR_BINARY);
+    n->op = op;
+    n->u.bin.left = left;
+    n->u.bin.right = right;
     return n;
 }
 
 static Node *parse_factor(Parser *p) {
     Token tk = peek_token(p);
     if (tk.type == T_NUMBER) {
-        Node *n = node_alloc(N_EXPR_NUMBER);
-        n->number = atof(tk.text);
+        Node *n = node_alloc(p->arena, N_EXPR_NUMBER);
+        n->u.number = token_number(p, tk);
         advance(p);
         return n;
     } else if (tk.type == T_STRING) {
-        Node *n = node_alloc(N_EXPR_STRING);
-        n->string = strdup(tk.text);
+        Node *n = node_alloc(p->arena, N_EXPR_STRING);
+        n->u.string = token_str(p, tk);
         advance(p);
         return n;
     } else if (tk.type == T_IDENTIFIER) {
-        char *name = strdup(tk.text);
+        Symbol *name = tk.sym;
         advance(p);
         if (peek_token(p).type == T_LPAREN) {
             advance(p);
             Node **args = NULL;
             int arg_count = 0;
             if (peek_token(p).type != T_RPAREN) {
-                args = malloc(16 * sizeof(Node*));
-                args[arg_count++] = parse_expression(p);
+                int base = p->nscratch;
+                scratch_push(p, parse_expression(p));
                 while (peek_token(p).type == T_COMMA) {
                     advance(p);
-                    args[arg_count++] = parse_expression(p);
+                    scratch_push(p, parse_expression(p));
                 }
+                arg_count = p->nscratch - base;
+                args = arena_alloc(p->arena, arg_count * sizeof(Node*));
+                for (int i = 0; i < arg_count; i++) args[i] = p->scratch[base + i];
+                p->nscratch = base;
             }
             expect(p, T_RPAREN, ")");
-            Node *n = node_alloc(N_EXPR_CALL);
-            n->name = name;
-            n->args = args;
-            n->arg_count = arg_count;
+            Node *n = node_alloc(p->arena, N_EXPR_CALL);
+            n->u.call.name = name;
+            n->u.call.args = args;
+            n->u.call.arg_count = arg_count;
             return n;
         } else {
-            Node *n = node_alloc(N_EXPR_VAR);
-            n->name = name;
+            Node *n = node_alloc(p->arena, N_EXPR_VAR);
+            n->u.var.name = name;
             return n;
         }
     } else if (tk.type == T_LPAREN) {
         advance(p);
-        Node *n = parse_expression(p);
+        Node *n = parse_compare(p);
         expect(p, T_RPAREN, ")");
         return n;
     } else if (tk.type == T_MINUS) {
         advance(p);
         Node *right = parse_factor(p);
-        Node *n = node_alloc(N_EXPR_BINARY);
-        n->left = node_alloc(N_EXPR_NUMBER);
-        n->left->number = 0;
-        n->right = right;
-        n->number = T_MINUS;
-        return n;
+        Node *zero = node_alloc(p->arena, N_EXPR_NUMBER);
+        zero->u.number = 0;
+        return binary_node(p, BIN_SUB, zero, right);
     }
     fprintf(stderr, "Parse error at line %d: unexpected token in factor\n", p->lx.line);
     exit(1);
@@ -551,11 +1172,7 @@ static Node *parse_term(Parser *p) {
         if (tk.type == T_MUL || tk.type == T_DIV || tk.type == T_MOD) {
             advance(p);
             Node *right = parse_factor(p);
-            Node *n = node_alloc(N_EXPR_BINARY);
-            n->left = left;
-            n->right = right;
-            n->number = tk.type;
-            left = n;
+            left = binary_node(p, binop_of(tk.type), left, right);
         } else {
             break;
         }
@@ -570,11 +1187,7 @@ static Node *parse_expression(Parser *p) {
         if (tk.type == T_PLUS || tk.type == T_MINUS) {
             advance(p);
             Node *right = parse_term(p);
-            Node *n = node_alloc(N_EXPR_BINARY);
-            n->left = left;
-            n->right = right;
-            n->number = tk.type;
-            left = n;
+            left = binary_node(p, binop_of(tk.type), left, right);
         } else {
             break;
         }
@@ -582,7 +1195,8 @@ static Node *parse_expression(Parser *p) {
     return left;
 }
 
-static Node *parse_compare(Parser *p) {
+/* A single comparison, or a plain expression. */
+static Node *parse_relation(Parser *p) {
     Node *node = parse_expression(p);
     Token tk = peek_token(p);
     TokenType comp = T_UNKNOWN;
@@ -594,42 +1208,124 @@ static Node *parse_compare(Parser *p) {
     else if (tk.type == T_NEQ) { comp = T_NEQ; advance(p); }
     if (comp != T_UNKNOWN) {
         Node *right = parse_expression(p);
-        Node *bin = node_alloc(N_EXPR_BINARY);
-        bin->left = node;
-        bin->right = right;
-        bin->number = comp;
-        node = bin;
+        node = binary_node(p, binop_of(comp), node, right);
     }
+    return node;
+}
+
+static Node *parse_negation(Parser *p) {
+    if (peek_token(p).type != T_NOT) return parse_relation(p);
+    advance(p);
+    Node *n = node_alloc(p->arena, N_EXPR_NOT);
+    n->u.expr = parse_negation(p);
+    return n;
+}
+
+static Node *logic_node(Parser *p, NodeType type, Node *left, Node *right) {
+    Node *n = node_alloc(p->arena, type);
+    n->u.bin.left = left;
+    n->u.bin.right = right;
+    return n;
+}
+
+static Node *parse_conjunction(Parser *p) {
+    Node *node = parse_negation(p);
     while (peek_token(p).type == T_AND) {
         advance(p);
-        Node *right = parse_compare(p);
-        Node *bin = node_alloc(N_EXPR_BINARY);
-        bin->left = node;
-        bin->right = right;
-        bin->number = T_AND;
-        node = bin;
+        node = logic_node(p, N_EXPR_AND, node, parse_negation(p));
+    }
+    return node;
+}
+
+/* Conditions: `or` binds loosest, then `and`, then `not`, then a single
+   comparison.  Both `and` and `or` skip their right side once the left
+   side decides the result. */
+static Node *parse_compare(Parser *p) {
+    Node *node = parse_conjunction(p);
+    while (peek_token(p).type == T_OR) {
+        advance(p);
+        node = logic_node(p, N_EXPR_OR, node, parse_conjunction(p));
     }
     return node;
 }
 
+/* match subject
+       case 1, 2 then ...
+       case "quit" then ...
+       else ...
+       end
+   Labels are number or string literals; the first case whose label equals
+   the subject runs, or else the else part. */
+static Node *parse_match_stmt(Parser *p) {
+    advance(p);  // consume T_MATCH
+    Node *subject = parse_expression(p);
+    Value *labels = NULL;
+    int *label_body = NULL, nlabels = 0, labels_cap = 0, body_cap = 0, base = p->nscratch;
+    while (peek_token(p).type == T_NEWLINE || peek_token(p).type == T_DOT) advance(p);
+    while (peek_token(p).type == T_CASE) {
+        advance(p);
+        do {
+            Token tk = peek_token(p);
+            int neg = tk.type == T_MINUS;
+            if (neg) { advance(p); tk = peek_token(p); }
+            Value label;
+            if (tk.type == T_NUMBER) label = num_val(neg ? -token_number(p, tk) : token_number(p, tk));
+            else if (tk.type == T_STRING && !neg) label = token_str(p, tk);
+            else {
+                fprintf(stderr, "Parse error at line %d: case label must be a number or string\n", p->lx.line);
+                exit(1);
+            }
+            advance(p);
+            labels = grow_array(labels, &labels_cap, nlabels + 1, sizeof(Value));
+            label_body = grow_array(label_body, &body_cap, nlabels + 1, sizeof(int));
+            labels[nlabels] = label;
+            label_body[nlabels++] = p->nscratch - base;
+        } while (accept(p, T_COMMA));
+        expect(p, T_THEN, "then");
+        scratch_push(p, parse_statements(p));
+    }
+    Node *else_body = NULL;
+    if (peek_token(p).sym == sym_else) {
+        advance(p);
+        else_body = parse_statements(p);
+    }
+    expect(p, T_END, "'end' to close match");
+    expect_stmt_terminator(p);
+    Node *n = node_alloc(p->arena, N_STMT_MATCH);
+    n->u.match.subject = subject;
+    n->u.match.ncases = p->nscratch - base;
+    n->u.match.bodies = arena_alloc(p->arena, n->u.match.ncases * sizeof(Node*));
+    for (int i = 0; i < n->u.match.ncases; i++) n->u.match.bodies[i] = p->scratch[base + i];
+    p->nscratch = base;
+    n->u.match.else_body = else_body;
+    n->u.match.table = match_build(p->arena, labels, label_body, nlabels);
+    free(labels);
+    free(label_body);
+    if (!n->u.match.table) {
+        fprintf(stderr, "Parse error at line %d: duplicate case label in match\n", p->lx.line);
+        exit(1);
+    }
+    return n;
+}
+
 static Node *parse_statements(Parser *p) {
     Node *head = NULL;
     Node **tail = &head;
     while (1) {
         Token t = peek_token(p);
-        if (t.type == T_EOF || t.type == T_END || t.type == T_THEN || t.type == T_DO ||
-            t.type == T_RBRACE || (t.type == T_IDENTIFIER && t.text && strcmp(t.text, "else") == 0)) break;
-        while (t.type == T_NEWLINE) {
+        while (t.type == T_NEWLINE || t.type == T_DOT) {   /* empty statements */
             advance(p);
             t = peek_token(p);
         }
+        if (t.type == T_EOF || t.type == T_END || t.type == T_THEN || t.type == T_DO ||
+            t.type == T_RBRACE || t.type == T_CASE || t.sym == sym_else) break;
         Node *stmt = parse_statement(p);
         if (!stmt) break;
         *tail = stmt;
         tail = &stmt->next;
     }
-    Node *list = node_alloc(N_STMT_LIST);
-    list->body = head;
+    Node *list = node_alloc(p->arena, N_STMT_LIST);
+    list->u.list = head;
     return list;
 }
 
@@ -644,22 +1340,22 @@ static Node *parse_statement(Parser *p) {
             fprintf(stderr, "Parse error at line %d: expected identifier after 'set'\n", p->lx.line);
             exit(1);
         }
-        char *name = strdup(peek_token(p).text);
+        Symbol *name = peek_token(p).sym;
         advance(p);
         expect(p, T_TO, "to");
         Node *expr = parse_expression(p);
         expect_stmt_terminator(p);
-        Node *n = node_alloc(N_STMT_SET);
-        n->name = name;
-        n->body = expr;
+        Node *n = node_alloc(p->arena, N_STMT_SET);
+        n->u.set.name = name;
+        n->u.set.expr = expr;
         return n;
 
     } else if (tk.type == T_PRINT) {
         advance(p);
         Node *expr = parse_expression(p);
         expect_stmt_terminator(p);
-        Node *n = node_alloc(N_STMT_PRINT);
-        n->body = expr;
+        Node *n = node_alloc(p->arena, N_STMT_PRINT);
+        n->u.expr = expr;
         return n;
 
     } else if (tk.type == T_READ) {
@@ -668,11 +1364,11 @@ static Node *parse_statement(Parser *p) {
             fprintf(stderr, "Parse error at line %d: expected identifier after 'read'\n", p->lx.line);
             exit(1);
         }
-        char *name = strdup(peek_token(p).text);
+        Symbol *name = peek_token(p).sym;
         advance(p);
         expect_stmt_terminator(p);
-        Node *n = node_alloc(N_STMT_READ);
-        n->name = name;
+        Node *n = node_alloc(p->arena, N_STMT_READ);
+        n->u.var.name = name;
         return n;
 
     } else if (tk.type == T_IF) {
@@ -682,39 +1378,60 @@ static Node *parse_statement(Parser *p) {
         Node *stmts = parse_statements(p);
         Node *else_body = NULL;
         Token t = peek_token(p);
-        if (t.type == T_IDENTIFIER && t.text && strcmp(t.text, "else") == 0) {
+        if (t.sym == sym_else) {
             advance(p);
             else_body = parse_statements(p);
         }
         expect(p, T_END, "'end' to close if");
         expect_stmt_terminator(p);
-        Node *n = node_alloc(N_STMT_IF);
-        n->cond = cond;
-        n->body = stmts;
-        n->else_body = else_body;
+        Node *n = node_alloc(p->arena, N_STMT_IF);
+        n->u.cond.cond = cond;
+        n->u.cond.body = stmts;
+        n->u.cond.else_body = else_body;
         return n;
 
     } else if (tk.type == T_WHILE) {
         advance(p);
         Node *cond = parse_compare(p);
         expect(p, T_DO, "do");
+        p->loops++;
         Node *stmts = parse_statements(p);
+        p->loops--;
         expect(p, T_END, "'end' to close while");
         expect_stmt_terminator(p);
-        Node *n = node_alloc(N_STMT_WHILE);
-        n->cond = cond;
-        n->body = stmts;
+        Node *n = node_alloc(p->arena, N_STMT_WHILE);
+        n->u.cond.cond = cond;
+        n->u.cond.body = stmts;
         return n;
 
     } else if (tk.type == T_FUNCTION) {
         return parse_func_def(p);
 
+    } else if (tk.sym == sym_memo && peek_next(p).type == T_FUNCTION) {
+        advance(p);  // consume "memo"; elsewhere it is an ordinary name
+        Node *n = parse_func_def(p);
+        n->u.func.memo = 1;
+        return n;
+
     } else if (tk.type == T_RETURN) {
         return parse_return_stmt(p);
 
     } else if (tk.type == T_FOR) {
         return parse_for_stmt(p);  // for is a full statement — NOT an expression
 
+    } else if (tk.type == T_MATCH) {
+        return parse_match_stmt(p);
+
+    } else if (tk.type == T_BREAK || tk.type == T_CONTINUE) {
+        if (p->loops == 0) {
+            fprintf(stderr, "Parse error at line %d: '%s' outside a loop\n", p->lx.line,
+                    tk.type == T_BREAK ? "break" : "continue");
+            exit(1);
+        }
+        advance(p);
+        expect_stmt_terminator(p);
+        return node_alloc(p->arena, tk.type == T_BREAK ? N_STMT_BREAK : N_STMT_CONTINUE);
+
     } else if (tk.type == T_DOT) {
         advance(p);
         return NULL;
@@ -726,353 +1443,2459 @@ static Node *parse_statement(Parser *p) {
         /* ----- Only pure expressions become implicit print statements ----- */
         Node *expr = parse_expression(p);
         expect_stmt_terminator(p);
-        Node *n = node_alloc(N_STMT_PRINT);
-        n->body = expr;
+        Node *n = node_alloc(p->arena, N_STMT_PRINT);
+        n->u.expr = expr;
         return n;
     }
 }
-/* ---------- Evaluation ---------- */
+/* ---------- Resolver ---------- */
+/* Gives every function its frame layout: parameters take the first slots and
+   each other name the body assigns (set, read, for) the next ones.  Uses of
+   those names inside the body get the slot; everything else, including all
+   top-level names, is left at -1 and looked up by name.  A nested function
+   has a frame of its own, so its definition is resolved after the enclosing
+   body has released Symbol.slot. */
+typedef struct {
+    Arena *arena;
+    Symbol *fn;                 // function whose body is being resolved, NULL at top level
+    int memo;                   // ... and whether it is a memo function
+    Symbol **locals; int nlocals, locals_cap;
+    Node **pending; int npending, pending_cap;
+    Node **defs; int ndefs, defs_cap;           // every function definition
+    Symbol **memo_calls; int nmemo_calls, memo_calls_cap;  // (memo function, callee) pairs
+} Resolver;
+
+static void resolve_add_local(Resolver *r, Symbol *name, int is_param) {
+    if (!is_param && name->slot >= 0) return;
+    r->locals = grow_array(r->locals, &r->locals_cap, r->nlocals + 1, sizeof(Symbol*));
+    r->locals[r->nlocals] = name;
+    /* a repeated parameter name binds the last argument */
+    name->slot = r->nlocals++;
+}
 
-static Value eval_expr(Node *n);
-static Value eval_stmt(Node *n, int *returned, Value *return_val) {
-    if (!n) return (Value){VAL_NONE, 0, NULL};
-    if (*returned) return value_dup(return_val);
+static void resolve_collect(Resolver *r, Node *n) {
+    if (!n) return;
     switch (n->type) {
-                case N_STMT_LIST: {
-            Node *c = n->body;
-            Value temp = (Value){VAL_NONE, 0, NULL};
-            while (c) {
-                value_free(&temp);
-                temp = eval_stmt(c, returned, return_val);
-                if (*returned) {
-                    Value rv = value_dup(return_val);
-                    value_free(&temp);
-                    return rv;
-                }
-                c = c->next;
+        case N_STMT_LIST:
+            for (Node *s = n->u.list; s; s = s->next) resolve_collect(r, s);
+            break;
+        case N_STMT_SET: resolve_add_local(r, n->u.set.name, 0); break;
+        case N_STMT_READ: resolve_add_local(r, n->u.var.name, 0); break;
+        case N_STMT_FOR: resolve_add_local(r, n->u.loop.var, 0); resolve_collect(r, n->u.loop.body); break;
+        case N_STMT_IF: resolve_collect(r, n->u.cond.body); resolve_collect(r, n->u.cond.else_body); break;
+        case N_STMT_MATCH:
+            for (int i = 0; i < n->u.match.ncases; i++) resolve_collect(r, n->u.match.bodies[i]);
+            resolve_collect(r, n->u.match.else_body);
+            break;
+        case N_STMT_WHILE: resolve_collect(r, n->u.cond.body); break;
+        default: break;
+    }
+}
+
+static void resolve_node(Resolver *r, Node *n) {
+    if (!n) return;
+    switch (n->type) {
+        case N_STMT_LIST:
+            for (Node *s = n->u.list; s; s = s->next) {
+                resolve_node(r, s);
+                n->calls |= s->calls;
             }
-            value_free(&temp);
-            /* A program (statement list) never returns a value */
-            return (Value){VAL_NONE, 0, NULL};
-        }
-        case N_STMT_SET: {
-            Value v = eval_expr(n->body);
-            var_set(n->name, v);
-            return v;
-        }
-        case N_STMT_PRINT: {
-            Value v = eval_expr(n->body);
-            if (v.type == VAL_NUM) printf("%g\n", v.num);
-            else if (v.type == VAL_STR) printf("%s\n", v.str ? v.str : "");
-            value_free(&v);
-            return (Value){VAL_NONE, 0, NULL};
-        }
-        case N_STMT_READ: {
-            char buf[256];
-            if (!fgets(buf, sizeof(buf), stdin)) {
-                fprintf(stderr, "Input error\n");
+            break;
+        case N_STMT_SET:
+            n->u.set.slot = n->u.set.name->slot;
+            resolve_node(r, n->u.set.expr);
+            n->calls = n->u.set.expr->calls;
+            break;
+        case N_STMT_READ: case N_STMT_PRINT:
+            /* a cached call would skip the output or input */
+            if (r->memo) {
+                fprintf(stderr, "Error: memo function %s cannot print or read\n", r->fn->name);
                 exit(1);
             }
-            buf[strcspn(buf, "\n")] = 0;
-            char *endptr;
-            double val = strtod(buf, &endptr);
-            if (endptr == buf || *endptr != '\0') {
-                Value strv = {VAL_STR, 0, strdup(buf)};
-                var_set(n->name, strv);
-                return value_dup(&strv);
+            if (n->type == N_STMT_PRINT) {
+                resolve_node(r, n->u.expr);
+                n->calls = n->u.expr->calls;
             } else {
-                Value numv = {VAL_NUM, val, NULL};
-                var_set(n->name, numv);
-                return numv;
-            }
-        }
-        case N_STMT_IF: {
-            Value condv = eval_expr(n->cond);
-            Value res = (Value){VAL_NONE, 0, NULL};
-            if (condv.type != VAL_NUM) {
-                fprintf(stderr, "Error: Condition must be numeric\n");
-                exit(1);
+                n->u.var.slot = n->u.var.name->slot;
             }
-            if (condv.num != 0.0) {
-                res = eval_stmt(n->body, returned, return_val);
-            } else if (n->else_body) {
-                res = eval_stmt(n->else_body, returned, return_val);
+            break;
+        case N_EXPR_VAR: n->u.var.slot = n->u.var.name->slot; break;
+        case N_STMT_RETURN:
+            resolve_node(r, n->u.expr);
+            /* a memo function's calls are cached, so each keeps its own frame */
+            if (n->u.expr && n->u.expr->type == N_EXPR_CALL && n->u.expr->u.call.name == r->fn && !r->memo)
+                n->u.expr->tail = 1;
+            n->calls = n->u.expr && n->u.expr->calls;
+            break;
+        case N_STMT_IF: case N_STMT_WHILE:
+            resolve_node(r, n->u.cond.cond);
+            resolve_node(r, n->u.cond.body);
+            resolve_node(r, n->u.cond.else_body);
+            n->calls = n->u.cond.cond->calls | n->u.cond.body->calls |
+                       (n->u.cond.else_body && n->u.cond.else_body->calls);
+            break;
+        case N_STMT_FOR:
+            n->u.loop.slot = n->u.loop.var->slot;
+            resolve_node(r, n->u.loop.from);
+            resolve_node(r, n->u.loop.to);
+            resolve_node(r, n->u.loop.step);
+            resolve_node(r, n->u.loop.body);
+            n->calls = n->u.loop.from->calls | n->u.loop.to->calls | n->u.loop.body->calls |
+                       (n->u.loop.step && n->u.loop.step->calls);
+            break;
+        case N_STMT_MATCH:
+            resolve_node(r, n->u.match.subject);
+            n->calls = n->u.match.subject->calls;
+            for (int i = 0; i < n->u.match.ncases; i++) {
+                resolve_node(r, n->u.match.bodies[i]);
+                n->calls |= n->u.match.bodies[i]->calls;
             }
-            value_free(&condv);
-            return res;
-        }
-        case N_STMT_WHILE: {
-            Value res = (Value){VAL_NONE, 0, NULL};
-            Value condv;
-            while (1) {
-                condv = eval_expr(n->cond);
-                if (condv.type != VAL_NUM || condv.num == 0.0 || *returned) {
-                    value_free(&condv);
-                    break;
-                }
-                value_free(&condv);
-                value_free(&res);
-                res = eval_stmt(n->body, returned, return_val);
-                if (*returned) {
-                    Value rv = value_dup(return_val);
-                    value_free(&res);
-                    return rv;
-                }
+            resolve_node(r, n->u.match.else_body);
+            n->calls |= n->u.match.else_body && n->u.match.else_body->calls;
+            break;
+        case N_STMT_FUNCDEF:
+            r->pending = grow_array(r->pending, &r->pending_cap, r->npending + 1, sizeof(Node*));
+            r->pending[r->npending++] = n;
+            r->defs = grow_array(r->defs, &r->defs_cap, r->ndefs + 1, sizeof(Node*));
+            r->defs[r->ndefs++] = n;
+            break;
+        case N_EXPR_BINARY: case N_EXPR_AND: case N_EXPR_OR:
+            resolve_node(r, n->u.bin.left);
+            resolve_node(r, n->u.bin.right);
+            n->calls = n->u.bin.left->calls | n->u.bin.right->calls;
+            break;
+        case N_EXPR_NOT:
+            resolve_node(r, n->u.expr);
+            n->calls = n->u.expr->calls;
+            break;
+        case N_EXPR_CALL:
+            for (int i = 0; i < n->u.call.arg_count; i++) resolve_node(r, n->u.call.args[i]);
+            n->calls = 1;
+            if (r->memo) {   /* checked once every definition is known */
+                r->memo_calls = grow_array(r->memo_calls, &r->memo_calls_cap, r->nmemo_calls + 2, sizeof(Symbol*));
+                r->memo_calls[r->nmemo_calls++] = r->fn;
+                r->memo_calls[r->nmemo_calls++] = n->u.call.name;
             }
-            return res;
+            break;
+        default: break;
+    }
+}
+
+/* A cache hit skips the body, so a memo function may only call memo
+   functions: a call to one that prints would print only on a miss.  A
+   name with no definition at all still fails when it is called. */
+static void check_memo_calls(const Resolver *r) {
+    for (int i = 0; i < r->nmemo_calls; i += 2)
+        for (int d = 0; d < r->ndefs; d++) {
+            const Node *def = r->defs[d];
+            if (def->u.func.name != r->memo_calls[i + 1] || def->u.func.memo) continue;
+            fprintf(stderr, "Error: memo function %s cannot call %s, which is not memo\n",
+                    r->memo_calls[i]->name, def->u.func.name->name);
+            exit(1);
         }
-                case N_STMT_FOR: {
-            /* ---- evaluate bounds and step ---- */
-            Value vfrom = eval_expr(n->from_expr);
-            Value vto   = eval_expr(n->to_expr);
-            Value vstep = (Value){VAL_NUM, 1.0, NULL};
-
-            if (n->step_expr) {
-                vstep = eval_expr(n->step_expr);
-                if (vstep.type != VAL_NUM) {
-                    fprintf(stderr, "Error: step must be numeric\n");
-                    value_free(&vfrom); value_free(&vto); value_free(&vstep);
-                    exit(1);
-                }
-            }
+}
 
-            if (vfrom.type != VAL_NUM || vto.type != VAL_NUM) {
-                fprintf(stderr, "Error: for-loop bounds must be numeric\n");
-                value_free(&vfrom); value_free(&vto); value_free(&vstep);
+static void resolve_program(Node *program, Arena *arena) {
+    Resolver r = {.arena = arena};
+    resolve_node(&r, program);
+    while (r.npending > 0) {
+        Node *def = r.pending[--r.npending];
+        r.fn = def->u.func.name;
+        r.memo = def->u.func.memo;
+        r.nlocals = 0;
+        for (int i = 0; i < def->u.func.param_count; i++) resolve_add_local(&r, def->u.func.params[i], 1);
+        resolve_collect(&r, def->u.func.body);
+        resolve_node(&r, def->u.func.body);
+        def->u.func.nlocals = r.nlocals;
+        def->u.func.locals = arena_alloc(arena, r.nlocals * sizeof(Symbol*));
+        for (int i = 0; i < r.nlocals; i++) {
+            def->u.func.locals[i] = r.locals[i];
+            r.locals[i]->slot = -1;
+        }
+    }
+    check_memo_calls(&r);
+    free(r.locals);
+    free(r.pending);
+    free(r.defs);
+    free(r.memo_calls);
+}
+
+/* ---------- Evaluation ---------- */
+
+/* Operations shared by the tree walker and the VM, so both engines print,
+   read and fail in exactly the same way. */
+static void print_value(const Value *v) {
+    if (is_num(*v)) printf("%g\n", val_num(*v));
+    else if (is_str(*v)) {
+        char buf[STR_INLINE_MAX + 1];
+        size_t len;
+        printf("%s\n", str_chars(v, buf, &len));
+    }
+}
+
+static Value read_value(void) {
+    char buf[256];
+    if (!fgets(buf, sizeof(buf), stdin)) {
+        fprintf(stderr, "Input error\n");
+        exit(1);
+    }
+    buf[strcspn(buf, "\n")] = 0;
+    char *endptr;
+    double val = strtod(buf, &endptr);
+    if (endptr == buf || *endptr != '\0') return str_make(buf, strlen(buf));
+    return num_val(isnan(val) ? NAN : val);   /* "nan(...)" payloads could look like tags */
+}
+
+/* fmod() is slow; positive whole operands (the usual `i % j`) take an
+   exact integer path with the same result. */
+static double num_mod(double x, double y) {
+    if (x >= 1.0 && y >= 1.0 && x < 9007199254740992.0 && y < 9007199254740992.0) {
+        int64_t ix = (int64_t)x, iy = (int64_t)y;
+        if ((double)ix == x && (double)iy == y) return (double)(ix % iy);
+    }
+    return fmod(x, y);
+}
+
+/* The text v contributes to a concatenation; NONE joins as 0. */
+static const char *concat_text(const Value *v, char buf[64], size_t *len) {
+    if (is_str(*v)) return str_chars(v, buf, len);
+    *len = (size_t)sprintf(buf, "%g", is_num(*v) ? val_num(*v) : 0.0);
+    return buf;
+}
+
+/* dst = dst + r in place when dst holds a string nothing else references,
+   doubling its capacity as needed, so accumulating a string one piece at a
+   time costs amortized O(1) per append.  Returns 0, leaving dst alone,
+   when that is not possible. */
+static int str_append(Value *dst, const Value *r) {
+    if (!is_heap_str(*dst)) return 0;
+    Str *s = val_str(*dst);
+    if (s->refs != 1 || (is_heap_str(*r) && val_str(*r) == s)) return 0;
+    char buf[64];
+    size_t len;
+    const char *text = concat_text(r, buf, &len);
+    size_t need = (size_t)s->len + len;
+    if (need > UINT32_MAX) { fprintf(stderr, "Error: String too long\n"); exit(1); }
+    if (need > s->cap) {
+        size_t cap = need < 32 ? 32 : need * 2 > UINT32_MAX ? UINT32_MAX : need * 2;
+        s = realloc(s, sizeof(Str) + cap + 1);
+        if (!s) { fprintf(stderr, "out of memory\n"); exit(1); }
+        s->cap = (uint32_t)cap;
+        *dst = str_val(s);
+    }
+    memcpy(s->chars + s->len, text, len);
+    s->len = (uint32_t)need;
+    s->chars[need] = '\0';
+    return 1;
+}
+
+/* Whether e reads x, directly or through a call (callees see the caller's
+   variables). */
+static int may_read(const Node *e, const Symbol *x) {
+    switch (e->type) {
+        case N_EXPR_VAR: return e->u.var.name == x;
+        case N_EXPR_CALL: return 1;
+        case N_EXPR_BINARY: case N_EXPR_AND: case N_EXPR_OR:
+            return may_read(e->u.bin.left, x) || may_read(e->u.bin.right, x);
+        case N_EXPR_NOT: return may_read(e->u.expr, x);
+        case N_EXPR_CACHED: return may_read(e->u.cached.expr, x);
+        case N_EXPR_IV: return may_read(e->u.iv.expr, x);
+        case N_EXPR_INLINE: return 1;
+        default: return 0;
+    }
+}
+
+/* Whether e is x + a + b + ... with x leftmost, so that "set x to e" can
+   append the operands to x one at a time: every operand after the first
+   is evaluated once x has already grown, so none of them may read x. */
+static int is_append_chain(const Node *e, const Symbol *x) {
+    if (e->type != N_EXPR_BINARY || e->op != BIN_ADD) return 0;
+    for (; e->type == N_EXPR_BINARY && e->op == BIN_ADD; e = e->u.bin.left) {
+        if (e->u.bin.left->type == N_EXPR_VAR) return e->u.bin.left->u.var.name == x;
+        if (may_read(e->u.bin.right, x)) return 0;
+    }
+    return 0;
+}
+
+/* l + r where at least one side is a string. */
+static Value concat_op(const Value *l, const Value *r) {
+    char lbuf[64], rbuf[64];
+    size_t llen, rlen;
+    const char *lstr = concat_text(l, lbuf, &llen);
+    const char *rstr = concat_text(r, rbuf, &rlen);
+    if (llen + rlen <= STR_INLINE_MAX) {
+        char joined[STR_INLINE_MAX];
+        memcpy(joined, lstr, llen);
+        memcpy(joined + llen, rstr, rlen);
+        return str_make(joined, llen + rlen);
+    }
+    Str *res = str_alloc(llen + rlen);
+    memcpy(res->chars, lstr, llen);
+    memcpy(res->chars + llen, rstr, rlen);
+    return str_val(res);
+}
+
+static Value num_op(BinOp op, double l, double r) {
+    switch (op) {
+        case BIN_ADD: return num_val(l + r);
+        case BIN_SUB: return num_val(l - r);
+        case BIN_MUL: return num_val(l * r);
+        case BIN_DIV:
+            if (r == 0) { fprintf(stderr, "Error: Division by zero\n"); exit(1); }
+            return num_val(l / r);
+        case BIN_MOD: return num_val(num_mod(l, r));
+        case BIN_EQ: return num_val(l == r ? 1 : 0);
+        case BIN_NEQ: return num_val(l != r ? 1 : 0);
+        case BIN_GT: return num_val(l > r ? 1 : 0);
+        case BIN_LT: return num_val(l < r ? 1 : 0);
+        case BIN_LE: return num_val(l <= r ? 1 : 0);
+        case BIN_GE: return num_val(l >= r ? 1 : 0);
+        default: return NONE_VAL;
+    }
+}
+
+/* Computes l op r into a fresh value; l and r are left untouched. */
+static Value binary_op(BinOp op, const Value *l, const Value *r) {
+    if (op == BIN_ADD && (is_str(*l) || is_str(*r))) return concat_op(l, r);
+    if (!is_num(*l) || !is_num(*r)) {
+        fprintf(stderr, "Error: Numeric operation on non-numeric types\n");
+        exit(1);
+    }
+    return num_op(op, val_num(*l), val_num(*r));
+}
+
+/* Quickening: the first time the tree-walker runs a binary node it records
+   the operand types in n->quick, and from then on takes the path made for
+   them behind a single type check.  A node whose operands change type
+   falls back to binary_op for good. */
+typedef enum {
+    QUICK_NEW,      // not run yet
+    QUICK_NUM,      // number op number
+    QUICK_CONCAT,   // string + string
+    QUICK_ANY       // mixed types seen: always binary_op
+} Quick;
+
+/* Computes node n on l and r, consuming both.  Callers test for QUICK_NUM
+   in line first; this handles the rest. */
+static Value quick_binary(Node *n, Value *l, Value *r) {
+    switch ((Quick)n->quick) {
+        case QUICK_NUM:
+            if (is_num(*l) && is_num(*r)) return num_op((BinOp)n->op, val_num(*l), val_num(*r));
+            n->quick = QUICK_ANY;
+            break;
+        case QUICK_CONCAT:
+            if (is_str(*l) && is_str(*r)) break;
+            n->quick = QUICK_ANY;
+            break;
+        case QUICK_NEW:
+            if (is_num(*l) && is_num(*r)) n->quick = QUICK_NUM;
+            else if (n->op == BIN_ADD && is_str(*l) && is_str(*r)) n->quick = QUICK_CONCAT;
+            else n->quick = QUICK_ANY;
+            break;
+        case QUICK_ANY: break;
+    }
+    Value result = n->quick == QUICK_CONCAT ? concat_op(l, r) : binary_op((BinOp)n->op, l, r);
+    value_free(l);
+    value_free(r);
+    return result;
+}
+
+/* The truth of an operand of and, or and not, which must be a number. */
+static int truth(const Value *v) {
+    if (!is_num(*v)) {
+        fprintf(stderr, "Error: Numeric operation on non-numeric types\n");
+        exit(1);
+    }
+    return val_num(*v) != 0.0;
+}
+
+/* Validates the bounds of a FOR loop and returns its iteration count. */
+static long for_prepare(const Value *vfrom, const Value *vto, const Value *vstep,
+                        double *start, double *end, double *step_val) {
+    if (!is_num(*vstep)) {
+        fprintf(stderr, "Error: step must be numeric\n");
+        exit(1);
+    }
+    if (!is_num(*vfrom) || !is_num(*vto)) {
+        fprintf(stderr, "Error: for-loop bounds must be numeric\n");
+        exit(1);
+    }
+    *start    = val_num(*vfrom);
+    *end      = val_num(*vto);
+    *step_val = val_num(*vstep);
+    if (*step_val == 0.0) {
+        fprintf(stderr, "Error: step cannot be zero\n");
+        exit(1);
+    }
+
+    /* ---- compute safe number of iterations ---- */
+    if (*step_val > 0.0) {
+        /* (end - start) / step + 1  →  floor to avoid overshoot */
+        double diff = *end - *start;
+        return diff < 0.0 ? 0 : (long)floor(diff / *step_val) + 1;
+    } else {
+        double diff = *start - *end;
+        return diff < 0.0 ? 0 : (long)floor(diff / (-*step_val)) + 1;
+    }
+}
+
+static Value eval_expr(Node *n);
+
+/* The storage of the variable a set statement assigns, if it holds a value. */
+static Value *var_own(const Symbol *name, int slot) {
+    Value *v = slot >= 0 ? &frame_stack.vals[current_frame->base + slot]
+                         : (name->id < globals.cap ? &globals.vals[name->id] : NULL);
+    return v && !is_unset(*v) ? v : NULL;
+}
+
+/* Appends the operands of the chain e (see is_append_chain) to x in order.
+   An operand cannot reassign x (a function's sets are local to it), but it
+   may borrow x or move the frame stack, so x is fetched again after each. */
+static void append_operands(Node *set, Node *e) {
+    if (e->u.bin.left->type == N_EXPR_BINARY) append_operands(set, e->u.bin.left);
+    Value r = eval_expr(e->u.bin.right);
+    Value *v = var_own(set->u.set.name, set->u.set.slot);
+    if (!str_append(v, &r)) {
+        Value res = binary_op(BIN_ADD, v, &r);
+        var_set(set->u.set.name, set->u.set.slot, res);
+    }
+    value_free(&r);
+}
+
+/* set x to x + a + ..., growing x's string in place when x is its only
+   holder.  Returns 0 when the general path must run instead. */
+static int append_to_var(Node *set) {
+    Value *v = var_own(set->u.set.name, set->u.set.slot);
+    if (!v || !is_heap_str(*v) || val_str(*v)->refs != 1) return 0;
+    append_operands(set, set->u.set.expr);
+    return 1;
+}
+
+/* Entering a loop that has invariants cached (-O) bumps this, which
+   invalidates every cached value. */
+static uint64_t cache_gen = 1;
+
+/* How a statement run by exec_direct finished. */
+typedef enum { FLOW_NORMAL, FLOW_RETURN, FLOW_BREAK, FLOW_CONTINUE } Flow;
+
+static Flow exec_direct(Node *n, Value *ret);
+
+/* Evaluates an expression that contains no call; its recursion is bounded by
+   how deeply the source nests. */
+static Value eval_expr(Node *n) {
+    if (!n) return NONE_VAL;
+    switch (n->type) {
+        case N_EXPR_NUMBER: return num_val(n->u.number);
+        case N_EXPR_STRING: return value_dup(&n->u.string);
+        case N_EXPR_VAR: {
+            Value *v = NULL;
+            if (n->u.var.slot >= 0) {
+                v = &frame_stack.vals[current_frame->base + n->u.var.slot];
+                if (is_unset(*v)) v = var_lookup(frame_caller(current_frame), n->u.var.name);
+            } else {
+                v = var_lookup(current_frame, n->u.var.name);
+            }
+            if (!v) {
+                fprintf(stderr, "Error: Undefined variable %s\n", n->u.var.name->name);
                 exit(1);
             }
+            return value_dup(v);
+        }
+        case N_EXPR_BINARY: {
+            Value l = eval_expr(n->u.bin.left);
+            Value r = eval_expr(n->u.bin.right);
+            if (n->quick == QUICK_NUM && is_num(l) && is_num(r)) return num_op((BinOp)n->op, val_num(l), val_num(r));
+            return quick_binary(n, &l, &r);
+        }
+        case N_EXPR_AND: case N_EXPR_OR: {
+            Value l = eval_expr(n->u.bin.left);
+            int lt = truth(&l);
+            if (lt == (n->type == N_EXPR_OR)) return num_val(lt);   /* the right side is skipped */
+            Value r = eval_expr(n->u.bin.right);
+            return num_val(truth(&r));
+        }
+        case N_EXPR_NOT: {
+            Value v = eval_expr(n->u.expr);
+            return num_val(!truth(&v));
+        }
+        case N_EXPR_CACHED: {
+            if (n->u.cached.gen == cache_gen) return num_val(n->u.cached.value);
+            Value v = eval_expr(n->u.cached.expr);
+            if (is_num(v)) {   /* a string is recomputed rather than shared */
+                n->u.cached.value = val_num(v);
+                n->u.cached.gen = cache_gen;
+            }
+            return v;
+        }
+        case N_EXPR_IV: return num_val(n->u.iv.value);
+        case N_EXPR_INLINE: {
+            if (!func_get(n->u.inl.name)) {
+                fprintf(stderr, "Error: Undefined function %s\n", n->u.inl.name->name);
+                exit(1);
+            }
+            for (int i = 0; i < n->u.inl.arg_count; i++) n->u.inl.vals[i] = eval_expr(n->u.inl.args[i]);
+            for (int i = n->u.inl.arg_count; i < n->u.inl.nvals; i++) n->u.inl.vals[i] = UNSET_VAL;
+            Value ret = NONE_VAL;
+            if (exec_direct(n->u.inl.body, &ret) != FLOW_RETURN) ret = NONE_VAL;
+            for (int i = 0; i < n->u.inl.nvals; i++) value_free(&n->u.inl.vals[i]);
+            return ret;
+        }
+        case N_EXPR_ARG: {
+            Value *v = &n->u.arg.inl->u.inl.vals[n->u.arg.index];
+            /* a local not yet assigned is the caller's, as it was for the callee */
+            if (is_unset(*v)) v = var_lookup(current_frame, n->u.arg.name);
+            if (!v) {
+                fprintf(stderr, "Error: Undefined variable %s\n", n->u.arg.name->name);
+                exit(1);
+            }
+            return value_dup(v);
+        }
+        default: return NONE_VAL;
+    }
+}
 
-            double start    = vfrom.num;
-            double end      = vto.num;
-            double step_val = vstep.num;
-
+/* Runs a statement that contains no call straight on the C stack, which its
+   nesting in the source bounds.  A `return` moves its value into *ret and
+   unwinds with FLOW_RETURN; break and continue unwind to their loop, or out
+   of n if the loop encloses it. */
+static Flow exec_direct(Node *n, Value *ret) {
+    switch (n->type) {
+        case N_STMT_LIST:
+            for (Node *c = n->u.list; c; c = c->next) {
+                Flow flow = exec_direct(c, ret);
+                if (flow != FLOW_NORMAL) return flow;
+            }
+            return FLOW_NORMAL;
+        case N_STMT_SET:
+            if (is_append_chain(n->u.set.expr, n->u.set.name) && append_to_var(n)) return FLOW_NORMAL;
+            var_set(n->u.set.name, n->u.set.slot, eval_expr(n->u.set.expr));
+            return FLOW_NORMAL;
+        case N_STMT_SET_ARG: {
+            Value v = eval_expr(n->u.set_arg.expr);
+            Node *arg = n->u.set_arg.arg;
+            value_free(&arg->u.arg.inl->u.inl.vals[arg->u.arg.index]);
+            arg->u.arg.inl->u.inl.vals[arg->u.arg.index] = v;
+            return FLOW_NORMAL;
+        }
+        case N_STMT_PRINT: {
+            Value v = eval_expr(n->u.expr);
+            print_value(&v);
+            value_free(&v);
+            return FLOW_NORMAL;
+        }
+        case N_STMT_READ:
+            var_set(n->u.var.name, n->u.var.slot, read_value());
+            return FLOW_NORMAL;
+        case N_STMT_IF: {
+            Value condv = eval_expr(n->u.cond.cond);
+            if (!is_num(condv)) {
+                fprintf(stderr, "Error: Condition must be numeric\n");
+                exit(1);
+            }
+            Node *body = val_num(condv) != 0.0 ? n->u.cond.body : n->u.cond.else_body;
+            return body ? exec_direct(body, ret) : FLOW_NORMAL;
+        }
+        case N_STMT_WHILE:
+            if (n->u.cond.cached) cache_gen++;
+            while (1) {
+                Value condv = eval_expr(n->u.cond.cond);
+                if (!is_num(condv) || val_num(condv) == 0.0) {
+                    value_free(&condv);
+                    return FLOW_NORMAL;
+                }
+                Flow flow = exec_direct(n->u.cond.body, ret);
+                if (flow == FLOW_RETURN) return FLOW_RETURN;
+                if (flow == FLOW_BREAK) return FLOW_NORMAL;
+            }
+        case N_STMT_FOR: {
+            Value vfrom = eval_expr(n->u.loop.from);
+            Value vto   = eval_expr(n->u.loop.to);
+            Value vstep = n->u.loop.step ? eval_expr(n->u.loop.step) : num_val(1.0);
+            double start, end, step;
+            long count = for_prepare(&vfrom, &vto, &vstep, &start, &end, &step);
             value_free(&vfrom);
             value_free(&vto);
             value_free(&vstep);
 
-            if (step_val == 0.0) {
-                fprintf(stderr, "Error: step cannot be zero\n");
-                exit(1);
+            /* The loop variable is bound once.  A local's slot cannot move, since
+               nothing here grows frame_stack; the globals table may grow when the
+               body sets a new name, so a global is re-found by index. */
+            int slot = n->u.loop.slot, id = n->u.loop.var->id;
+            Value *local = slot >= 0 ? &frame_stack.vals[current_frame->base + slot] : NULL;
+            if (!local) global_slot(n->u.loop.var);
+            if (n->u.loop.cached) cache_gen++;
+            for (Node *iv = n->u.loop.ivs; iv; iv = iv->next) {
+                double k = iv->u.iv.scale;
+                /* whole numbers below 2^53 add exactly */
+                iv->u.iv.exact = start == floor(start) && step == floor(step) && k == floor(k) &&
+                                 (fabs(start) + fabs(step) * (double)count) * fabs(k) < 9007199254740992.0;
+                iv->u.iv.delta = step * k;
             }
+            for (long iter = 0; iter < count; ++iter) {
+                double current = start + iter * step;
+                /* final safeguard – clamp to the exact bound */
+                if ((step > 0.0 && current > end + 1e-9) || (step < 0.0 && current < end - 1e-9)) break;
+                Value *v = local ? local : &globals.vals[id];
+                if (is_heap_str(*v)) str_release(val_str(*v));   /* the body may have stored a string */
+                *v = num_val(current);
+                for (Node *iv = n->u.loop.ivs; iv; iv = iv->next)
+                    if (!iv->u.iv.exact || iter == 0 || (iv->u.iv.value += iv->u.iv.delta) == 0.0)
+                        iv->u.iv.value = current * iv->u.iv.scale;   /* a zero takes its sign from the product */
+                Flow flow = exec_direct(n->u.loop.body, ret);
+                if (flow == FLOW_RETURN) return FLOW_RETURN;
+                if (flow == FLOW_BREAK) break;
+            }
+            return FLOW_NORMAL;
+        }
+        case N_STMT_MATCH: {
+            Value v = eval_expr(n->u.match.subject);
+            int i = match_find(n->u.match.table, &v);
+            value_free(&v);
+            Node *body = i >= 0 ? n->u.match.bodies[i] : n->u.match.else_body;
+            return body ? exec_direct(body, ret) : FLOW_NORMAL;
+        }
+        case N_STMT_BREAK: return FLOW_BREAK;
+        case N_STMT_CONTINUE: return FLOW_CONTINUE;
+        case N_STMT_FUNCDEF:
+            func_set(n);
+            return FLOW_NORMAL;
+        case N_STMT_RETURN:
+            *ret = n->u.expr ? eval_expr(n->u.expr) : num_val(0.0);
+            return FLOW_RETURN;
+        default:
+            return FLOW_NORMAL;
+    }
+}
 
-            Value res = (Value){VAL_NONE, 0, NULL};
+/* The tree walker keeps nothing on the C stack across an elang call, so
+   recursion is bounded by memory and --max-depth rather than by the thread
+   stack.  Every statement, and every expression that contains a call, runs
+   as a Task on an explicit stack; a task that needs a subexpression's value
+   schedules it and resumes, at its saved state, once that value is waiting
+   on frame_stack above the current frame's slots.  Call-free expressions
+   and statements run directly, through eval_expr and exec_direct. */
+typedef struct {
+    Node *n;
+    int state;                  // how far n has got, 0 on entry
+    union {
+        Node *next;             // N_STMT_LIST: statement to run next
+        struct { int base, arg; } call;   // N_EXPR_CALL: callee slots, next argument
+        struct { double start, end, step; long iter, count; } loop;   // N_STMT_FOR
+    } u;
+} Task;
+
+static struct { Task *vals; int top, cap; } task_stack;
+
+static void task_push(Node *n) {
+    if (task_stack.top == task_stack.cap)
+        task_stack.vals = grow_array(task_stack.vals, &task_stack.cap, task_stack.top + 1, sizeof(Task));
+    Task *t = &task_stack.vals[task_stack.top++];
+    t->n = n;
+    t->state = 0;
+}
 
-            /* ---- compute safe number of iterations ---- */
-            long max_iters;
-            if (step_val > 0.0) {
-                /* (end - start) / step + 1  →  floor to avoid overshoot */
-                double diff = end - start;
-                if (diff < 0.0) { max_iters = 0; }
-                else            { max_iters = (long)floor(diff / step_val) + 1; }
-            } else {
-                double diff = start - end;
-                if (diff < 0.0) { max_iters = 0; }
-                else            { max_iters = (long)floor(diff / (-step_val)) + 1; }
-            }
+static void value_push(Value v) {
+    if (frame_stack.top == frame_stack.cap)
+        frame_stack.vals = grow_array(frame_stack.vals, &frame_stack.cap, frame_stack.top + 1, sizeof(Value));
+    frame_stack.vals[frame_stack.top++] = v;
+}
+
+static Value value_pop(void) { return frame_stack.vals[--frame_stack.top]; }
+
+/* Leaves the value of e on the value stack and returns 1 when e has no call.
+   Otherwise schedules e and returns 0: the current task must yield, and
+   finds the value there when it resumes. */
+static int eval_or_schedule(Node *e) {
+    if (e->calls) { task_push(e); return 0; }
+    value_push(eval_expr(e));
+    return 1;
+}
+
+static void call_enter(const FuncDef *f, int base, int task) {
+    check_depth(call_stack.top + 1);
+    call_stack.vals = grow_array(call_stack.vals, &call_stack.cap, call_stack.top + 1, sizeof(Frame));
+    call_stack.vals[call_stack.top] = (Frame){f, base, task};
+    current_frame = &call_stack.vals[call_stack.top++];
+}
+
+/* Leaves the innermost call, dropping whatever its body still had scheduled,
+   and completes the call expression with result.  A memo function finds its
+   arguments as they were on entry just above its slots. */
+static void call_leave(Value result) {
+    const FuncDef *f = current_frame->fn;
+    if (f->memo) memo_store(f->memo, &frame_stack.vals[current_frame->base + f->nlocals], &result);
+    task_stack.top = current_frame->task;
+    frame_pop(current_frame->base);
+    call_stack.top--;
+    current_frame = call_stack.top ? &call_stack.vals[call_stack.top - 1] : NULL;
+    value_push(result);
+}
 
-            for (long iter = 0; iter < max_iters; ++iter) {
-                double current = start + iter * step_val;
+/* Completes the innermost call with v, or ends the program at top level. */
+static void return_value(Value v) {
+    if (current_frame) {
+        call_leave(v);
+    } else {
+        value_free(&v);
+        task_stack.top = 0;
+    }
+}
+
+/* break and continue drop the tasks of the statements around them up to
+   their loop's task: break ends the loop, and continue leaves it to start
+   the next iteration. */
+static void loop_unwind(Flow flow) {
+    NodeType t;
+    while ((t = task_stack.vals[task_stack.top - 1].n->type) != N_STMT_WHILE && t != N_STMT_FOR)
+        task_stack.top--;
+    if (flow == FLOW_BREAK) task_stack.top--;
+}
 
+/* Runs the program until it ends or executes a top-level return. */
+static void eval_program(Node *program) {
+    task_push(program);
+    while (task_stack.top > 0) {
+        Task *t = &task_stack.vals[task_stack.top - 1];
+        Node *n = t->n;
+        if (!n->calls && n->type < N_EXPR_BINARY) {
+            Value ret = NONE_VAL;
+            task_stack.top--;
+            Flow flow = exec_direct(n, &ret);
+            if (flow == FLOW_RETURN) return_value(ret);
+            else if (flow != FLOW_NORMAL) loop_unwind(flow);
+            continue;
+        }
+        switch (n->type) {
+            case N_STMT_LIST: {
+                if (t->state == 0) { t->state = 1; t->u.next = n->u.list; }
+                Node *c = t->u.next;
+                if (!c || !c->next) task_stack.top--;   /* the last statement takes the list's place */
+                else t->u.next = c->next;
+                if (c) task_push(c);
+                break;
+            }
+            case N_STMT_SET:
+                if (t->state == 0) {
+                    if (is_append_chain(n->u.set.expr, n->u.set.name) && append_to_var(n)) {
+                        task_stack.top--;
+                        break;
+                    }
+                    t->state = 1;
+                    if (!eval_or_schedule(n->u.set.expr)) break;
+                }
+                var_set(n->u.set.name, n->u.set.slot, value_pop());   /* the variable now owns it */
+                task_stack.top--;
+                break;
+            case N_STMT_PRINT: {
+                if (t->state == 0) { t->state = 1; if (!eval_or_schedule(n->u.expr)) break; }
+                Value v = value_pop();
+                print_value(&v);
+                value_free(&v);
+                task_stack.top--;
+                break;
+            }
+            case N_STMT_READ:
+                var_set(n->u.var.name, n->u.var.slot, read_value());
+                task_stack.top--;
+                break;
+            case N_STMT_IF: {
+                if (t->state == 0) { t->state = 1; if (!eval_or_schedule(n->u.cond.cond)) break; }
+                Value condv = value_pop();
+                if (!is_num(condv)) {
+                    fprintf(stderr, "Error: Condition must be numeric\n");
+                    exit(1);
+                }
+                Node *body = val_num(condv) != 0.0 ? n->u.cond.body : n->u.cond.else_body;
+                task_stack.top--;
+                if (body) task_push(body);
+                break;
+            }
+            case N_STMT_MATCH: {
+                if (t->state == 0) { t->state = 1; if (!eval_or_schedule(n->u.match.subject)) break; }
+                Value v = value_pop();
+                int i = match_find(n->u.match.table, &v);
+                value_free(&v);
+                Node *body = i >= 0 ? n->u.match.bodies[i] : n->u.match.else_body;
+                task_stack.top--;
+                if (body) task_push(body);
+                break;
+            }
+            case N_STMT_WHILE: {
+                if (t->state == 0) { t->state = 1; if (!eval_or_schedule(n->u.cond.cond)) break; }
+                Value condv = value_pop();
+                if (!is_num(condv) || val_num(condv) == 0.0) {
+                    value_free(&condv);
+                    task_stack.top--;
+                    break;
+                }
+                t->state = 0;
+                task_push(n->u.cond.body);
+                break;
+            }
+            case N_STMT_FOR: {
+                /* ---- evaluate bounds and step ---- */
+                if (t->state == 0) { t->state = 1; if (!eval_or_schedule(n->u.loop.from)) break; }
+                if (t->state == 1) { t->state = 2; if (!eval_or_schedule(n->u.loop.to)) break; }
+                if (t->state == 2) {
+                    t->state = 3;
+                    if (!n->u.loop.step) value_push(num_val(1.0));
+                    else if (!eval_or_schedule(n->u.loop.step)) break;
+                }
+                if (t->state == 3) {
+                    Value vstep = value_pop(), vto = value_pop(), vfrom = value_pop();
+                    t->u.loop.count = for_prepare(&vfrom, &vto, &vstep,
+                                                  &t->u.loop.start, &t->u.loop.end, &t->u.loop.step);
+                    value_free(&vfrom);
+                    value_free(&vto);
+                    value_free(&vstep);
+                    t->u.loop.iter = 0;
+                    t->state = 4;
+                }
+
+                /* ---- one iteration per resumption ---- */
+                double current = t->u.loop.start + t->u.loop.iter * t->u.loop.step;
                 /* final safeguard – clamp to the exact bound */
-                if ((step_val > 0.0 && current > end + 1e-9) ||
-                    (step_val < 0.0 && current < end - 1e-9)) {
+                if (t->u.loop.iter >= t->u.loop.count ||
+                    (t->u.loop.step > 0.0 && current > t->u.loop.end + 1e-9) ||
+                    (t->u.loop.step < 0.0 && current < t->u.loop.end - 1e-9)) {
+                    task_stack.top--;
+                    break;
+                }
+                t->u.loop.iter++;
+                var_set(n->u.loop.var, n->u.loop.slot, num_val(current));   /* set loop variable */
+                task_push(n->u.loop.body);
+                break;
+            }
+            case N_STMT_FUNCDEF:
+                func_set(n);
+                task_stack.top--;
+                break;
+            case N_STMT_RETURN: {
+                if (t->state == 0) {
+                    t->state = 1;
+                    if (!n->u.expr) value_push(num_val(0.0));
+                    else if (!eval_or_schedule(n->u.expr)) break;
+                }
+                return_value(value_pop());
+                break;
+            }
+            case N_EXPR_BINARY: {
+                if (t->state == 0) { t->state = 1; if (!eval_or_schedule(n->u.bin.left)) break; }
+                if (t->state == 1) { t->state = 2; if (!eval_or_schedule(n->u.bin.right)) break; }
+                Value r = value_pop(), l = value_pop();
+                task_stack.top--;
+                value_push(quick_binary(n, &l, &r));
+                break;
+            }
+            case N_EXPR_AND: case N_EXPR_OR: {
+                if (t->state == 0) { t->state = 1; if (!eval_or_schedule(n->u.bin.left)) break; }
+                if (t->state == 1) {
+                    Value l = value_pop();
+                    int lt = truth(&l);
+                    if (lt == (n->type == N_EXPR_OR)) {   /* the right side is skipped */
+                        task_stack.top--;
+                        value_push(num_val(lt));
+                        break;
+                    }
+                    t->state = 2;
+                    if (!eval_or_schedule(n->u.bin.right)) break;
+                }
+                Value r = value_pop();
+                task_stack.top--;
+                value_push(num_val(truth(&r)));
+                break;
+            }
+            case N_EXPR_NOT: {
+                if (t->state == 0) { t->state = 1; if (!eval_or_schedule(n->u.expr)) break; }
+                Value v = value_pop();
+                task_stack.top--;
+                value_push(num_val(!truth(&v)));
+                break;
+            }
+            case N_EXPR_CALL: {
+                FuncDef *f = n->u.call.fn;
+                if (t->state == 0) {
+                    /* ---- Link the call site; a definition is never replaced ---- */
+                    if (!f) {
+                        f = func_get(n->u.call.name);
+                        if (!f) {
+                            fprintf(stderr, "Error: Undefined function %s\n", n->u.call.name->name);
+                            exit(1);
+                        }
+                        if (f->param_count != n->u.call.arg_count) {
+                            fprintf(stderr, "Error: Function %s expects %d args, got %d\n",
+                                    n->u.call.name->name, f->param_count, n->u.call.arg_count);
+                            exit(1);
+                        }
+                        n->u.call.fn = f;
+                    }
+                    t->u.call.base = frame_push(f->nlocals);
+                    t->u.call.arg = 0;
+                    t->state = 1;
+                } else if (t->state == 1) {
+                    /* a scheduled argument has its value */
+                    frame_stack.vals[t->u.call.base + t->u.call.arg++] = value_pop();
+                } else {
+                    call_leave(NONE_VAL);   /* the body ended without return */
                     break;
                 }
 
-                Value iv = {VAL_NUM, current, NULL};
-                var_set(n->var, iv);          /* set loop variable */
+                /* ---- Evaluate the arguments into the new frame's parameter slots ---- */
+                int scheduled = 0;
+                while (!scheduled && t->u.call.arg < f->param_count) {
+                    Node *a = n->u.call.args[t->u.call.arg];
+                    if (a->calls) { task_push(a); scheduled = 1; }
+                    else frame_stack.vals[t->u.call.base + t->u.call.arg++] = eval_expr(a);
+                }
+                if (scheduled) break;
+
+                if (f->memo) {
+                    const Value *hit = memo_find(f->memo, &frame_stack.vals[t->u.call.base]);
+                    if (hit) {
+                        Value v = value_dup(hit);
+                        frame_pop(t->u.call.base);
+                        task_stack.top--;
+                        value_push(v);
+                        break;
+                    }
+                }
 
-                value_free(&res);
-                res = eval_stmt(n->body, returned, return_val);
-                if (*returned) {
-                    Value rv = value_dup(return_val);
-                    value_free(&res);
-                    return rv;
+                if (n->tail) {
+                    /* ---- `return f(...)` inside f: rerun the body in this frame ----
+                       The arguments replace the parameters; other locals keep their
+                       values, which is what a read of one not yet set would have
+                       found in the frame below, so dynamic scoping is unchanged. */
+                    Value *slots = &frame_stack.vals[current_frame->base];
+                    for (int i = 0; i < f->param_count; i++) {
+                        value_free(&slots[i]);
+                        slots[i] = frame_stack.vals[t->u.call.base + i];
+                    }
+                    frame_stack.top = t->u.call.base;   /* the rest are still unset */
+                    task_stack.top = current_frame->task + 1;
+                    task_push(f->body);
+                    break;
                 }
+
+                /* ---- Enter the frame and run the body ---- */
+                t->state = 2;
+                call_enter(f, t->u.call.base, task_stack.top - 1);
+                if (f->memo)   /* the key, kept safe from the body's sets */
+                    for (int i = 0; i < f->param_count; i++)
+                        value_push(value_dup(&frame_stack.vals[t->u.call.base + i]));
+                task_push(f->body);
+                break;
             }
-            return res;
+            default:
+                task_stack.top--;
+                break;
         }
-        case N_STMT_FUNCDEF: {
-            func_set(n->name, n->params, n->param_count, n->body);
-            return (Value){VAL_NONE, 0, NULL};
+    }
+    free(task_stack.vals);
+    task_stack.vals = NULL;
+    task_stack.cap = 0;
+}
+
+/* ---------- Constant Folding ---------- */
+/* Runs once between parsing and resolving, so both engines see the result.
+   An operator whose operands are literals becomes the literal it computes,
+   unless computing it fails: 1 / 0 and "a" * 2 are kept and fail when they
+   run, as before.  x * 1, 1 * x, x / 1 and x - 0 become x when x always
+   yields a number.  x + 0 is kept: it appends "0" to a string x and turns
+   -0 into 0. */
+
+/* Whether e yields a number whenever it yields a value. */
+static int is_numeric(const Node *e) {
+    switch (e->type) {
+        case N_EXPR_NUMBER: case N_EXPR_AND: case N_EXPR_OR: case N_EXPR_NOT: return 1;
+        case N_EXPR_BINARY:
+            return e->op != BIN_ADD || (is_numeric(e->u.bin.left) && is_numeric(e->u.bin.right));
+        default: return 0;
+    }
+}
+
+static int is_literal(const Node *e) { return e->type == N_EXPR_NUMBER || e->type == N_EXPR_STRING; }
+
+static int is_number_lit(const Node *e, double x) {
+    return e->type == N_EXPR_NUMBER && e->u.number == x && !signbit(e->u.number);
+}
+
+/* Turns operator node n into the literal v; every operator node is at
+   least as large as a literal. */
+static void make_literal(Arena *a, Node *n, Value v) {
+    if (is_num(v)) {
+        n->type = N_EXPR_NUMBER;
+        n->u.number = val_num(v);
+    } else {
+        char buf[STR_INLINE_MAX + 1];
+        size_t len;
+        const char *chars = str_chars(&v, buf, &len);
+        n->type = N_EXPR_STRING;
+        n->u.string = arena_str(a, chars, len);
+        value_free(&v);
+    }
+}
+
+/* Folds the expressions under n and returns what replaces n. */
+static Node *fold(Arena *a, Node *n) {
+    if (!n) return NULL;
+    switch (n->type) {
+        case N_STMT_LIST:
+            for (Node *c = n->u.list; c; c = c->next) fold(a, c);
+            break;
+        case N_STMT_SET: n->u.set.expr = fold(a, n->u.set.expr); break;
+        case N_STMT_PRINT: case N_STMT_RETURN: n->u.expr = fold(a, n->u.expr); break;
+        case N_STMT_IF: case N_STMT_WHILE:
+            n->u.cond.cond = fold(a, n->u.cond.cond);
+            fold(a, n->u.cond.body);
+            fold(a, n->u.cond.else_body);
+            break;
+        case N_STMT_FOR:
+            n->u.loop.from = fold(a, n->u.loop.from);
+            n->u.loop.to = fold(a, n->u.loop.to);
+            n->u.loop.step = fold(a, n->u.loop.step);
+            fold(a, n->u.loop.body);
+            break;
+        case N_STMT_MATCH:
+            n->u.match.subject = fold(a, n->u.match.subject);
+            for (int i = 0; i < n->u.match.ncases; i++) fold(a, n->u.match.bodies[i]);
+            fold(a, n->u.match.else_body);
+            break;
+        case N_STMT_FUNCDEF: fold(a, n->u.func.body); break;
+        case N_EXPR_CALL:
+            for (int i = 0; i < n->u.call.arg_count; i++) n->u.call.args[i] = fold(a, n->u.call.args[i]);
+            break;
+        case N_EXPR_NOT: {
+            Node *e = n->u.expr = fold(a, n->u.expr);
+            if (e->type == N_EXPR_NUMBER) make_literal(a, n, num_val(e->u.number == 0.0));
+            break;
         }
-        case N_STMT_RETURN: {
-            Value ret_val;
-            if (n->body) {
-                ret_val = eval_expr(n->body);
-            } else {
-                ret_val = (Value){VAL_NUM, 0.0, NULL};
+        case N_EXPR_AND: case N_EXPR_OR: {
+            Node *l = n->u.bin.left = fold(a, n->u.bin.left);
+            Node *r = n->u.bin.right = fold(a, n->u.bin.right);
+            if (l->type != N_EXPR_NUMBER) break;
+            int lt = l->u.number != 0.0;
+            if (lt == (n->type == N_EXPR_OR)) make_literal(a, n, num_val(lt));   /* r never runs */
+            else if (r->type == N_EXPR_NUMBER) make_literal(a, n, num_val(r->u.number != 0.0));
+            break;
+        }
+        case N_EXPR_BINARY: {
+            Node *l = n->u.bin.left = fold(a, n->u.bin.left);
+            Node *r = n->u.bin.right = fold(a, n->u.bin.right);
+            if (is_literal(l) && is_literal(r)) {
+                int nums = l->type == N_EXPR_NUMBER && r->type == N_EXPR_NUMBER;
+                if (nums ? !(n->op == BIN_DIV && r->u.number == 0.0) : n->op == BIN_ADD) {
+                    Value lv = l->type == N_EXPR_NUMBER ? num_val(l->u.number) : l->u.string;
+                    Value rv = r->type == N_EXPR_NUMBER ? num_val(r->u.number) : r->u.string;
+                    make_literal(a, n, binary_op((BinOp)n->op, &lv, &rv));
+                }
+                break;
             }
-            *returned = 1;
-            *return_val = value_dup(&ret_val);
-            value_free(&ret_val);
-            return value_dup(return_val);
+            if (n->op == BIN_MUL && is_number_lit(r, 1.0) && is_numeric(l)) return l;
+            if (n->op == BIN_MUL && is_number_lit(l, 1.0) && is_numeric(r)) return r;
+            if (n->op == BIN_DIV && is_number_lit(r, 1.0) && is_numeric(l)) return l;
+            if (n->op == BIN_SUB && is_number_lit(r, 0.0) && is_numeric(l)) return l;
+            break;
         }
-        default: return (Value){VAL_NONE, 0, NULL};
+        default: break;
     }
+    return n;
 }
 
-static Value eval_expr(Node *n) {
-    if (!n) return (Value){VAL_NONE, 0, NULL};
+/* ---------- Inlining ---------- */
+/* With -O, a call to a small function is replaced by a copy of its body
+   where nothing can tell the two apart:
+   - the function is defined once in the program and is not memo;
+   - its body calls nothing, so it is not recursive and no callee looks up
+     its locals by name;
+   - the body is set, if, while, match, break, continue, print and return
+     statements over expressions, at most INLINE_BUDGET nodes in all;
+   - the call passes as many arguments as there are parameters, and none
+     of them calls anything.
+   The copy, an N_EXPR_INLINE node, still fails with "Undefined function"
+   when it runs before the definition.  The callee's locals are renamed
+   into the node's own storage: each use of one becomes an N_EXPR_ARG for
+   its frame slot, and each set an N_STMT_SET_ARG.  A local read before it
+   is assigned, and every other name, is looked up from the caller's
+   frame, exactly as the callee would have fallen back to it.  An inlined
+   call takes no frame, so it no longer counts towards --max-depth. */
+#define INLINE_BUDGET 32
+
+typedef struct {
+    Arena *arena;
+    Node **defs; int ndefs, defs_cap;   // every function definition in the program
+} Inliner;
+
+static void collect_defs(Inliner *in, Node *n) {
+    if (!n) return;
     switch (n->type) {
-        case N_EXPR_NUMBER: return (Value){VAL_NUM, n->number, NULL};
-        case N_EXPR_STRING: return (Value){VAL_STR, 0, strdup(n->string ? n->string : "")};
-        case N_EXPR_VAR: {
-            Var *v = var_get(n->name);
-            if (!v) {
-                fprintf(stderr, "Error: Undefined variable %s\n", n->name);
-                exit(1);
+        case N_STMT_LIST:
+            for (Node *s = n->u.list; s; s = s->next) collect_defs(in, s);
+            break;
+        case N_STMT_IF: case N_STMT_WHILE:
+            collect_defs(in, n->u.cond.body);
+            collect_defs(in, n->u.cond.else_body);
+            break;
+        case N_STMT_FOR: collect_defs(in, n->u.loop.body); break;
+        case N_STMT_MATCH:
+            for (int i = 0; i < n->u.match.ncases; i++) collect_defs(in, n->u.match.bodies[i]);
+            collect_defs(in, n->u.match.else_body);
+            break;
+        case N_STMT_FUNCDEF:
+            in->defs = grow_array(in->defs, &in->defs_cap, in->ndefs + 1, sizeof(Node*));
+            in->defs[in->ndefs++] = n;
+            collect_defs(in, n->u.func.body);
+            break;
+        default: break;
+    }
+}
+
+/* Whether n has a shape that may be inlined, counting its nodes off *budget. */
+static int inline_shape(const Node *n, int *budget) {
+    if (!n) return 1;
+    if (--*budget < 0) return 0;
+    switch (n->type) {
+        case N_STMT_LIST:
+            for (const Node *s = n->u.list; s; s = s->next) if (!inline_shape(s, budget)) return 0;
+            return 1;
+        case N_STMT_SET: return inline_shape(n->u.set.expr, budget);
+        case N_STMT_IF: case N_STMT_WHILE:
+            return inline_shape(n->u.cond.cond, budget) && inline_shape(n->u.cond.body, budget) &&
+                   inline_shape(n->u.cond.else_body, budget);
+        case N_STMT_MATCH:
+            for (int i = 0; i < n->u.match.ncases; i++) if (!inline_shape(n->u.match.bodies[i], budget)) return 0;
+            return inline_shape(n->u.match.subject, budget) && inline_shape(n->u.match.else_body, budget);
+        case N_STMT_PRINT: case N_STMT_RETURN: case N_EXPR_NOT: return inline_shape(n->u.expr, budget);
+        case N_EXPR_BINARY: case N_EXPR_AND: case N_EXPR_OR:
+            return inline_shape(n->u.bin.left, budget) && inline_shape(n->u.bin.right, budget);
+        case N_STMT_BREAK: case N_STMT_CONTINUE:
+        case N_EXPR_NUMBER: case N_EXPR_STRING: case N_EXPR_VAR: return 1;
+        default: return 0;
+    }
+}
+
+/* The definition a call to name may be replaced with, or NULL. */
+static Node *inline_target(const Inliner *in, const Symbol *name) {
+    Node *def = NULL;
+    for (int i = 0; i < in->ndefs; i++) {
+        if (in->defs[i]->u.func.name != name) continue;
+        if (def) return NULL;
+        def = in->defs[i];
+    }
+    int budget = INLINE_BUDGET;
+    if (!def || def->u.func.memo || def->u.func.body->calls || !inline_shape(def->u.func.body, &budget))
+        return NULL;
+    return def;
+}
+
+static Node *inline_arg(Arena *a, Node *inl, Symbol *name, int slot) {
+    Node *arg = node_alloc(a, N_EXPR_ARG);
+    arg->u.arg.inl = inl;
+    arg->u.arg.index = slot;
+    arg->u.arg.name = name;
+    return arg;
+}
+
+/* Copies n, a part of a function body, into the N_EXPR_INLINE node inl.
+   The resolver has given each of the function's locals its frame slot,
+   which becomes the local's index in inl's storage. */
+static Node *inline_copy(Arena *a, const Node *n, Node *inl) {
+    if (!n) return NULL;
+    if (n->type == N_EXPR_VAR && n->u.var.slot >= 0) return inline_arg(a, inl, n->u.var.name, n->u.var.slot);
+    if (n->type == N_STMT_SET) {   /* everything the function assigns is a local */
+        Node *c = node_alloc(a, N_STMT_SET_ARG);
+        c->u.set_arg.arg = inline_arg(a, inl, n->u.set.name, n->u.set.slot);
+        c->u.set_arg.expr = inline_copy(a, n->u.set.expr, inl);
+        return c;
+    }
+    Node *c = node_alloc(a, n->type);
+    memcpy(c, n, node_sizes[n->type]);
+    c->next = NULL;
+    switch (n->type) {
+        case N_STMT_LIST: {
+            Node **tail = &c->u.list;
+            *tail = NULL;
+            for (const Node *s = n->u.list; s; s = s->next) {
+                *tail = inline_copy(a, s, inl);
+                tail = &(*tail)->next;
             }
-            return value_dup(&v->val);
+            break;
         }
-                case N_EXPR_CALL: {
-            FuncDef *f = func_get(n->name);
-            if (!f) {
-                fprintf(stderr, "Error: Undefined function %s\n", n->name);
-                exit(1);
-            }
-            if (f->param_count != n->arg_count) {
-                fprintf(stderr, "Error: Function %s expects %d args, got %d\n",
-                        n->name, f->param_count, n->arg_count);
-                exit(1);
+        case N_STMT_IF: case N_STMT_WHILE:
+            c->u.cond.cond = inline_copy(a, n->u.cond.cond, inl);
+            c->u.cond.body = inline_copy(a, n->u.cond.body, inl);
+            c->u.cond.else_body = inline_copy(a, n->u.cond.else_body, inl);
+            break;
+        case N_STMT_MATCH:
+            c->u.match.subject = inline_copy(a, n->u.match.subject, inl);
+            c->u.match.bodies = arena_alloc(a, n->u.match.ncases * sizeof(Node*));
+            for (int i = 0; i < n->u.match.ncases; i++)
+                c->u.match.bodies[i] = inline_copy(a, n->u.match.bodies[i], inl);
+            c->u.match.else_body = inline_copy(a, n->u.match.else_body, inl);
+            break;
+        case N_STMT_PRINT: case N_STMT_RETURN: case N_EXPR_NOT:
+            c->u.expr = inline_copy(a, n->u.expr, inl);
+            break;
+        case N_EXPR_BINARY: case N_EXPR_AND: case N_EXPR_OR:
+            c->u.bin.left = inline_copy(a, n->u.bin.left, inl);
+            c->u.bin.right = inline_copy(a, n->u.bin.right, inl);
+            break;
+        default: break;
+    }
+    return c;
+}
+
+/* Inlines the calls under n, innermost first, updates the calls flags the
+   resolver set and returns what replaces n. */
+static Node *inline_calls(Inliner *in, Node *n) {
+    if (!n) return NULL;
+    switch (n->type) {
+        case N_STMT_LIST:
+            n->calls = 0;
+            for (Node *s = n->u.list; s; s = s->next) n->calls |= inline_calls(in, s)->calls;
+            break;
+        case N_STMT_SET:
+            n->u.set.expr = inline_calls(in, n->u.set.expr);
+            n->calls = n->u.set.expr->calls;
+            break;
+        case N_STMT_PRINT: case N_STMT_RETURN: case N_EXPR_NOT:
+            n->u.expr = inline_calls(in, n->u.expr);
+            n->calls = n->u.expr && n->u.expr->calls;
+            break;
+        case N_STMT_IF: case N_STMT_WHILE:
+            n->u.cond.cond = inline_calls(in, n->u.cond.cond);
+            inline_calls(in, n->u.cond.body);
+            inline_calls(in, n->u.cond.else_body);
+            n->calls = n->u.cond.cond->calls | n->u.cond.body->calls |
+                       (n->u.cond.else_body && n->u.cond.else_body->calls);
+            break;
+        case N_STMT_FOR:
+            n->u.loop.from = inline_calls(in, n->u.loop.from);
+            n->u.loop.to = inline_calls(in, n->u.loop.to);
+            n->u.loop.step = inline_calls(in, n->u.loop.step);
+            inline_calls(in, n->u.loop.body);
+            n->calls = n->u.loop.from->calls | n->u.loop.to->calls |
+                       (n->u.loop.step && n->u.loop.step->calls) | n->u.loop.body->calls;
+            break;
+        case N_STMT_MATCH:
+            n->u.match.subject = inline_calls(in, n->u.match.subject);
+            n->calls = n->u.match.subject->calls;
+            for (int i = 0; i < n->u.match.ncases; i++) n->calls |= inline_calls(in, n->u.match.bodies[i])->calls;
+            if (n->u.match.else_body) n->calls |= inline_calls(in, n->u.match.else_body)->calls;
+            break;
+        case N_STMT_FUNCDEF: inline_calls(in, n->u.func.body); break;
+        case N_EXPR_BINARY: case N_EXPR_AND: case N_EXPR_OR:
+            n->u.bin.left = inline_calls(in, n->u.bin.left);
+            n->u.bin.right = inline_calls(in, n->u.bin.right);
+            n->calls = n->u.bin.left->calls | n->u.bin.right->calls;
+            break;
+        case N_EXPR_CALL: {
+            int calls = n->tail;
+            for (int i = 0; i < n->u.call.arg_count; i++) {
+                n->u.call.args[i] = inline_calls(in, n->u.call.args[i]);
+                calls |= n->u.call.args[i]->calls;
             }
+            Node *def = calls ? NULL : inline_target(in, n->u.call.name);
+            if (!def || def->u.func.param_count != n->u.call.arg_count) break;
+            Node *inl = node_alloc(in->arena, N_EXPR_INLINE);
+            inl->u.inl.name = n->u.call.name;
+            inl->u.inl.args = n->u.call.args;
+            inl->u.inl.arg_count = n->u.call.arg_count;
+            inl->u.inl.nvals = def->u.func.nlocals;
+            inl->u.inl.vals = arena_alloc(in->arena, def->u.func.nlocals * sizeof(Value));
+            inl->u.inl.body = inline_copy(in->arena, def->u.func.body, inl);
+            return inl;
+        }
+        default: break;
+    }
+    return n;
+}
+
+static void inline_program(Arena *a, Node *ast) {
+    Inliner in = {.arena = a};
+    collect_defs(&in, ast);
+    if (in.ndefs) inline_calls(&in, ast);
+    free(in.defs);
+}
+
+/* ---------- Loop Optimization ---------- */
+/* With -O, loops that contain no call are rewritten after resolving.  Such
+   a loop runs to completion inside exec_direct and never re-enters itself,
+   and only its own statements can assign the variables it reads: whatever
+   a callee assigns is local to the callee.
+   - An operator subexpression that reads no variable the loop assigns is
+     invariant and becomes an N_EXPR_CACHED node, which keeps its first
+     numeric result until an optimized loop is next entered.  It is still
+     computed where it first occurs rather than before the loop, so it
+     fails, if at all, at the same point and in the same order as before.
+   - In a for loop whose body leaves the loop variable i alone, i * c and
+     c * i with a literal c become an N_EXPR_IV node that the loop steps
+     along with i, by adding step * c while that sum stays exact. */
+typedef struct {
+    Arena *arena;
+    Node *loop;
+    Symbol **assigned; int nassigned, assigned_cap;  // names the loop assigns
+    Symbol *iv_var;             // for loop variable the body leaves alone, or NULL
+} LoopOpt;
+
+static int assigns(const LoopOpt *lo, const Symbol *x) {
+    for (int i = 0; i < lo->nassigned; i++) if (lo->assigned[i] == x) return 1;
+    return 0;
+}
 
-            /* ---- Evaluate all arguments ---- */
-            Value *arg_values = malloc(f->param_count * sizeof(Value));
-            if (!arg_values) { perror("malloc"); exit(1); }
+static void add_assigned(LoopOpt *lo, Symbol *x) {
+    if (assigns(lo, x)) return;
+    lo->assigned = grow_array(lo->assigned, &lo->assigned_cap, lo->nassigned + 1, sizeof(Symbol*));
+    lo->assigned[lo->nassigned++] = x;
+}
 
-            for (int i = 0; i < f->param_count; i++) {
-                arg_values[i] = eval_expr(n->args[i]);
-            }
+/* Collects the names the statements under n assign; a nested function has
+   a frame of its own. */
+static void collect_assigned(LoopOpt *lo, Node *n) {
+    if (!n) return;
+    switch (n->type) {
+        case N_STMT_LIST:
+            for (Node *s = n->u.list; s; s = s->next) collect_assigned(lo, s);
+            break;
+        case N_STMT_SET: add_assigned(lo, n->u.set.name); break;
+        case N_STMT_READ: add_assigned(lo, n->u.var.name); break;
+        case N_STMT_IF: case N_STMT_WHILE:
+            collect_assigned(lo, n->u.cond.body);
+            collect_assigned(lo, n->u.cond.else_body);
+            break;
+        case N_STMT_FOR: add_assigned(lo, n->u.loop.var); collect_assigned(lo, n->u.loop.body); break;
+        case N_STMT_MATCH:
+            for (int i = 0; i < n->u.match.ncases; i++) collect_assigned(lo, n->u.match.bodies[i]);
+            collect_assigned(lo, n->u.match.else_body);
+            break;
+        default: break;
+    }
+}
+
+static int is_invariant(const LoopOpt *lo, const Node *e) {
+    switch (e->type) {
+        case N_EXPR_NUMBER: case N_EXPR_STRING: case N_EXPR_CACHED: return 1;
+        case N_EXPR_VAR: return !assigns(lo, e->u.var.name);
+        case N_EXPR_BINARY: case N_EXPR_AND: case N_EXPR_OR:
+            return is_invariant(lo, e->u.bin.left) && is_invariant(lo, e->u.bin.right);
+        case N_EXPR_NOT: return is_invariant(lo, e->u.expr);
+        default: return 0;
+    }
+}
+
+/* Rewrites expression e inside the loop and returns what replaces it. */
+static Node *opt_expr(LoopOpt *lo, Node *e) {
+    if (!e || e->type < N_EXPR_BINARY || e->type == N_EXPR_NUMBER || e->type == N_EXPR_STRING ||
+        e->type == N_EXPR_VAR || e->type == N_EXPR_CALL || e->type >= N_EXPR_CACHED) return e;
+    if (is_invariant(lo, e)) {
+        Node *c = node_alloc(lo->arena, N_EXPR_CACHED);
+        Node **list = lo->loop->type == N_STMT_FOR ? &lo->loop->u.loop.cached : &lo->loop->u.cond.cached;
+        c->u.cached.expr = e;
+        c->next = *list;
+        *list = c;
+        return c;
+    }
+    if (e->type == N_EXPR_NOT) {
+        e->u.expr = opt_expr(lo, e->u.expr);
+        return e;
+    }
+    Node *l = e->u.bin.left, *r = e->u.bin.right;
+    if (r->type == N_EXPR_VAR) { l = r; r = e->u.bin.left; }
+    if (e->type == N_EXPR_BINARY && e->op == BIN_MUL && lo->iv_var && r->type == N_EXPR_NUMBER &&
+        l->type == N_EXPR_VAR && l->u.var.name == lo->iv_var) {
+        Node *iv = node_alloc(lo->arena, N_EXPR_IV);
+        iv->u.iv.expr = e;
+        iv->u.iv.scale = r->u.number;
+        iv->next = lo->loop->u.loop.ivs;
+        lo->loop->u.loop.ivs = iv;
+        return iv;
+    }
+    e->u.bin.left = opt_expr(lo, e->u.bin.left);
+    e->u.bin.right = opt_expr(lo, e->u.bin.right);
+    return e;
+}
+
+/* Rewrites the expressions the statements under n evaluate on each pass
+   through the loop. */
+static void opt_exprs(LoopOpt *lo, Node *n) {
+    if (!n) return;
+    switch (n->type) {
+        case N_STMT_LIST:
+            for (Node *s = n->u.list; s; s = s->next) opt_exprs(lo, s);
+            break;
+        case N_STMT_SET: n->u.set.expr = opt_expr(lo, n->u.set.expr); break;
+        case N_STMT_PRINT: case N_STMT_RETURN: n->u.expr = opt_expr(lo, n->u.expr); break;
+        case N_STMT_IF: case N_STMT_WHILE:
+            n->u.cond.cond = opt_expr(lo, n->u.cond.cond);
+            opt_exprs(lo, n->u.cond.body);
+            opt_exprs(lo, n->u.cond.else_body);
+            break;
+        case N_STMT_FOR:
+            n->u.loop.from = opt_expr(lo, n->u.loop.from);
+            n->u.loop.to = opt_expr(lo, n->u.loop.to);
+            n->u.loop.step = opt_expr(lo, n->u.loop.step);
+            opt_exprs(lo, n->u.loop.body);
+            break;
+        case N_STMT_MATCH:
+            n->u.match.subject = opt_expr(lo, n->u.match.subject);
+            for (int i = 0; i < n->u.match.ncases; i++) opt_exprs(lo, n->u.match.bodies[i]);
+            opt_exprs(lo, n->u.match.else_body);
+            break;
+        default: break;
+    }
+}
 
-            /* ---- Push new scope and bind parameters ---- */
-            push_scope();
-            for (int i = 0; i < f->param_count; i++) {
-                var_set(f->params[i], arg_values[i]);   /* deep copy via value_dup */
-                /* DO NOT free here — function body may still use the string */
+/* Optimizes every call-free loop under n, outer loops first. */
+static void optimize_loops(Arena *a, Node *n) {
+    if (!n) return;
+    switch (n->type) {
+        case N_STMT_LIST:
+            for (Node *s = n->u.list; s; s = s->next) optimize_loops(a, s);
+            break;
+        case N_STMT_IF:
+            optimize_loops(a, n->u.cond.body);
+            optimize_loops(a, n->u.cond.else_body);
+            break;
+        case N_STMT_MATCH:
+            for (int i = 0; i < n->u.match.ncases; i++) optimize_loops(a, n->u.match.bodies[i]);
+            optimize_loops(a, n->u.match.else_body);
+            break;
+        case N_STMT_FUNCDEF: optimize_loops(a, n->u.func.body); break;
+        case N_STMT_WHILE: case N_STMT_FOR: {
+            int is_for = n->type == N_STMT_FOR;
+            Node *body = is_for ? n->u.loop.body : n->u.cond.body;
+            if (!n->calls) {
+                LoopOpt lo = {.arena = a, .loop = n};
+                collect_assigned(&lo, body);
+                if (is_for && !assigns(&lo, n->u.loop.var)) lo.iv_var = n->u.loop.var;
+                if (is_for) add_assigned(&lo, n->u.loop.var);
+                else n->u.cond.cond = opt_expr(&lo, n->u.cond.cond);
+                opt_exprs(&lo, body);
+                free(lo.assigned);
             }
+            optimize_loops(a, body);
+            break;
+        }
+        default: break;
+    }
+}
+
+/* ---------- Bytecode ---------- */
+/* The VM engine (--engine=vm) lowers the AST into register bytecode: one Proto
+   per function plus one for the main program.  A frame is a window onto a
+   single contiguous value stack.  Its low registers are the locals (parameters
+   first, then every name the body assigns) and temporaries sit above them; in
+   the main program the locals are the globals.  A name a function reads but
+   never assigns is looked up through the calling frames at run time, which is
+   the same dynamic scoping var_get implements for the tree walker. */
+
+typedef enum {
+    OP_LOADK,       /* A Bx    R[A] = K[Bx]                                    */
+    OP_MOVE,        /* A B     R[A] = R[B]                                     */
+    OP_GETCHK,      /* A B     R[A] = R[B], or the callers' binding if unset   */
+    OP_GETDYN,      /* A Bx    R[A] = variable symbol Bx from the callers      */
+    OP_FILL,        /* A Bx    if R[A] is unset, R[A] = symbol Bx from this frame out */
+    OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,             /* A B C  R[A] = RK[B] op RK[C] */
+    OP_EQ, OP_NEQ, OP_LT, OP_LE, OP_GT, OP_GE,          /* A B C  R[A] = RK[B] op RK[C] */
+    OP_IFEQ, OP_IFNEQ, OP_IFLT, OP_IFLE, OP_IFGT, OP_IFGE, /* B C  skip next JMP if RK[B] op RK[C] */
+    OP_TESTIF,      /* B       skip next JMP if RK[B] is true (if condition)   */
+    OP_TESTWHILE,   /* B       skip next JMP if RK[B] is true (while condition)*/
+    OP_TESTNUM,     /* B       skip next JMP if RK[B] is true (and/or/not operand) */
+    OP_JMP,         /* Bx      pc = Bx                                         */
+    OP_JMPNUM,      /* A Bx    pc = Bx if R[A] holds a number                  */
+    OP_MATCH,       /* B C     take the JMP after this one for the case of RK[B]
+                               in matches[C], or the next JMP if none matches  */
+    OP_FORPREP,     /* A       check R[A..A+2] = from, to, step; R[A+3] = count */
+    OP_FORITER,     /* A B     R[B] = next loop value and skip next JMP, if any */
+    OP_PRINT,       /* B       print RK[B]                                     */
+    OP_READ,        /* A       R[A] = line read from stdin                     */
+    OP_FUNCDEF,     /* Bx      define function protos[Bx]                      */
+    OP_FCHECK,      /* Bx      resolve call site Bx and check its arity        */
+    OP_CALL,        /* A Bx    R[A] = call site Bx applied to R[A..]           */
+    OP_TAILCALL,    /* A       rerun this function with R[A..] as its arguments */
+    OP_RET,         /* B       return RK[B]                                    */
+    OP_RETNONE      /*         return without a value                          */
+} OpCode;
+
+#define KB 1 /* Instr.k: operand B is a constant index */
+#define KC 2 /* Instr.k: operand C is a constant index */
+
+typedef struct {
+    uint8_t op;
+    uint8_t k;
+    uint16_t a, b, c;
+} Instr;
+
+#define INSTR_BX(i) (((uint32_t)(i).b << 16) | (i).c)
+#define MAX_REGS 0xFFFF
+
+typedef struct {
+    Symbol *name; // callee
+    int argc;
+    FuncDef *fn;  // resolved by the first OP_FCHECK; definitions never change
+} CallSite;
+
+typedef struct Proto {
+    Symbol *name;                // NULL for the main program
+    Node *def;                   // N_STMT_FUNCDEF node, NULL for the main program
+    Symbol **locals; int locals_cap; // slot names, parameters first
+    int nlocals, nparams, nregs;
+    Instr *code; int ncode, code_cap;
+    Value *k; int nk, k_cap;     // constants; strings are borrowed from the AST
+    struct Memo *memo; int memo_key; // memo function: its cache, and a copy of the arguments from register memo_key
+    CallSite *calls; int ncalls, calls_cap;
+    struct Proto **protos; int nprotos, protos_cap;
+    MatchTable **matches; int nmatches, matches_cap;  // owned by the AST
+} Proto;
+
+/* ---------- Bytecode Compiler ---------- */
+
+/* Open-addressing map from constant Values (numbers or strings) to indices. */
+typedef struct { Value key; int val; } MapEntry;
+typedef struct { MapEntry *e; int cap, count; } ValueMap;
+
+static int map_get(const ValueMap *m, const Value *key) {
+    if (!m->cap) return -1;
+    for (uint32_t i = value_hash(key) & (m->cap - 1);; i = (i + 1) & (m->cap - 1)) {
+        if (m->e[i].val < 0) return -1;
+        if (value_same(&m->e[i].key, key)) return m->e[i].val;
+    }
+}
+
+static void map_put(ValueMap *m, Value key, int val) {
+    if ((m->count + 1) * 2 > m->cap) {
+        MapEntry *old = m->e;
+        int old_cap = m->cap;
+        m->cap = old_cap ? old_cap * 2 : 64;
+        m->e = malloc(m->cap * sizeof(MapEntry));
+        if (!m->e) { fprintf(stderr, "out of memory\n"); exit(1); }
+        for (int i = 0; i < m->cap; i++) m->e[i].val = -1;
+        m->count = 0;
+        for (int i = 0; i < old_cap; i++) if (old[i].val >= 0) map_put(m, old[i].key, old[i].val);
+        free(old);
+    }
+    uint32_t i = value_hash(&key) & (m->cap - 1);
+    while (m->e[i].val >= 0 && !value_same(&m->e[i].key, &key)) i = (i + 1) & (m->cap - 1);
+    if (m->e[i].val < 0) m->count++;
+    m->e[i].key = key;
+    m->e[i].val = val;
+}
+
+typedef struct {
+    Proto *p;
+    int freereg;            // first free temporary register
+    ValueMap consts;        // constant -> index in p->k
+    int *saved_slots;       // Symbol.slot of each local before this proto claimed it
+    Node **defs; int ndefs; // nested functions, compiled once this body is done
+    /* Definite assignment: da[slot] is set once every path to the current
+       point has assigned the local, so reads can skip the unset check.
+       trail records slots in the order they became assigned, for undo. */
+    char *da;
+    int *trail; int ntrail;
+    int brk, cont;          // innermost loop: its break jumps (-1 = none) and continue target
+    /* While an inlined body is compiled, its returns put their value in
+       inl_dst and jump to the end (inl_exit, a jump list). */
+    int inlining, inl_dst, inl_exit;
+} Compiler;
+
+static int emit(Compiler *c, OpCode op, int k, int a, int b, int cc) {
+    Proto *p = c->p;
+    p->code = grow_array(p->code, &p->code_cap, p->ncode + 1, sizeof(Instr));
+    p->code[p->ncode] = (Instr){(uint8_t)op, (uint8_t)k, (uint16_t)a, (uint16_t)b, (uint16_t)cc};
+    return p->ncode++;
+}
+
+static int emit_bx(Compiler *c, OpCode op, int a, uint32_t bx) {
+    return emit(c, op, 0, a, (int)(bx >> 16), (int)(bx & 0xFFFF));
+}
+
+/* Forward jumps are patched in lists: until then a JMP's Bx holds the
+   index of the next JMP in its list plus one, and 0 ends the list. */
+static int emit_jump(Compiler *c) { return emit_bx(c, OP_JMP, 0, 0); }
+
+static uint32_t jump_link(Compiler *c, int at) {
+    return ((uint32_t)c->p->code[at].b << 16) | c->p->code[at].c;
+}
+
+static void jump_set(Compiler *c, int at, uint32_t target) {
+    c->p->code[at].b = (uint16_t)(target >> 16);
+    c->p->code[at].c = (uint16_t)(target & 0xFFFF);
+}
+
+/* Appends jump list l2 to l1 and returns the joined list. */
+static int jump_concat(Compiler *c, int l1, int l2) {
+    int at = l1;
+    while (jump_link(c, at)) at = (int)jump_link(c, at) - 1;
+    jump_set(c, at, (uint32_t)l2 + 1);
+    return l1;
+}
+
+/* Adds the fresh jump j to the front of list, in constant time, so that
+   collecting many exits stays linear. */
+static int jump_push(Compiler *c, int list, int j) {
+    jump_set(c, j, (uint32_t)list + 1);
+    return j;
+}
+
+/* Points every jump of the list at the next instruction. */
+static void patch_jump(Compiler *c, int list) {
+    for (uint32_t at = (uint32_t)list + 1; at; ) {
+        uint32_t next = jump_link(c, (int)at - 1);
+        jump_set(c, (int)at - 1, (uint32_t)c->p->ncode);
+        at = next;
+    }
+}
+
+static int alloc_reg(Compiler *c) {
+    int r = c->freereg++;
+    if (c->freereg > MAX_REGS) {
+        fprintf(stderr, "Error: %s is too large to compile\n", c->p->name ? c->p->name->name : "program");
+        exit(1);
+    }
+    if (c->freereg > c->p->nregs) c->p->nregs = c->freereg;
+    return r;
+}
+
+static int add_const(Compiler *c, Value v) {
+    int idx = map_get(&c->consts, &v);
+    if (idx >= 0) return idx;
+    Proto *p = c->p;
+    p->k = grow_array(p->k, &p->k_cap, p->nk + 1, sizeof(Value));
+    p->k[p->nk] = v;
+    map_put(&c->consts, v, p->nk);
+    return p->nk++;
+}
+
+static int num_const(Compiler *c, double d) { return add_const(c, num_val(d)); }
+
+/* While a proto is compiled, each of its locals' Symbol.slot holds the
+   register, so resolving a name is a single load. */
+static void add_local(Compiler *c, Symbol *name, int is_param) {
+    if (!is_param && name->slot >= 0) return;
+    Proto *p = c->p;
+    int cap = p->locals_cap;
+    p->locals = grow_array(p->locals, &p->locals_cap, p->nlocals + 1, sizeof(Symbol*));
+    if (p->locals_cap != cap) c->saved_slots = realloc(c->saved_slots, p->locals_cap * sizeof(int));
+    p->locals[p->nlocals] = name;
+    c->saved_slots[p->nlocals] = name->slot;
+    /* a repeated parameter name binds the last argument, as var_set does */
+    name->slot = p->nlocals++;
+}
+
+/* Every name a body assigns is local to it; nested function bodies are
+   compiled on their own. */
+static void collect_locals(Compiler *c, Node *n) {
+    if (!n) return;
+    switch (n->type) {
+        case N_STMT_LIST:
+            for (Node *s = n->u.list; s; s = s->next) collect_locals(c, s);
+            break;
+        case N_STMT_SET: add_local(c, n->u.set.name, 0); break;
+        case N_STMT_READ: add_local(c, n->u.var.name, 0); break;
+        case N_STMT_FOR: add_local(c, n->u.loop.var, 0); collect_locals(c, n->u.loop.body); break;
+        case N_STMT_IF: collect_locals(c, n->u.cond.body); collect_locals(c, n->u.cond.else_body); break;
+        case N_STMT_MATCH:
+            for (int i = 0; i < n->u.match.ncases; i++) collect_locals(c, n->u.match.bodies[i]);
+            collect_locals(c, n->u.match.else_body);
+            break;
+        case N_STMT_WHILE: collect_locals(c, n->u.cond.body); break;
+        default: break;
+    }
+}
+
+static void da_set(Compiler *c, int slot) {
+    if (c->da[slot]) return;
+    c->da[slot] = 1;
+    c->trail[c->ntrail++] = slot;
+}
+
+static void da_undo(Compiler *c, int mark) {
+    while (c->ntrail > mark) c->da[c->trail[--c->ntrail]] = 0;
+}
+
+static OpCode binary_opcode(BinOp op) { return (OpCode)(OP_ADD + op); }
+
+static int is_compare(BinOp op) { return op >= BIN_EQ && op <= BIN_GE; }
+
+static void compile_expr_to(Compiler *c, Node *n, int dst);
+static void compile_stmt(Compiler *c, Node *n);
+static Proto *compile_proto(Node *body, Symbol *name, Symbol **params, int nparams, Node *def);
+
+/* Emits a call with its arguments in fresh registers base, base+1, ...
+   and returns base, which holds the result afterwards.  A self tail call
+   (op OP_TAILCALL) reuses the current frame and never falls through. */
+static int call_site(Compiler *c, Symbol *name, int argc) {
+    Proto *p = c->p;
+    p->calls = grow_array(p->calls, &p->calls_cap, p->ncalls + 1, sizeof(CallSite));
+    p->calls[p->ncalls] = (CallSite){name, argc, NULL};
+    int site = p->ncalls++;
+    emit_bx(c, OP_FCHECK, 0, site);
+    return site;
+}
+
+static int compile_call(Compiler *c, Node *n, OpCode op) {
+    int site = call_site(c, n->u.call.name, n->u.call.arg_count);
+    int base = c->freereg;
+    for (int i = 0; i < n->u.call.arg_count; i++) compile_expr_to(c, n->u.call.args[i], alloc_reg(c));
+    c->freereg = base;
+    alloc_reg(c);
+    emit_bx(c, op, base, site);
+    return base;
+}
+
+static void compile_expr_to(Compiler *c, Node *n, int dst);
+
+/* An inlined call checks its function is defined, as a call would, puts
+   the arguments and then the unset locals in fresh registers and runs the
+   copied body, whose returns leave their value in dst; falling off its
+   end leaves none. */
+static void compile_inline(Compiler *c, Node *n, int dst) {
+    int save = c->freereg, outer_dst = c->inl_dst, outer_exit = c->inl_exit;
+    call_site(c, n->u.inl.name, n->u.inl.arg_count);
+    n->u.inl.reg = c->freereg;
+    for (int i = 0; i < n->u.inl.arg_count; i++) compile_expr_to(c, n->u.inl.args[i], alloc_reg(c));
+    for (int i = n->u.inl.arg_count; i < n->u.inl.nvals; i++)
+        emit_bx(c, OP_LOADK, alloc_reg(c), add_const(c, UNSET_VAL));
+    c->inlining++;
+    c->inl_dst = dst;
+    c->inl_exit = -1;
+    compile_stmt(c, n->u.inl.body);
+    emit_bx(c, OP_LOADK, dst, add_const(c, NONE_VAL));
+    patch_jump(c, c->inl_exit);
+    c->inlining--;
+    c->inl_dst = outer_dst;
+    c->inl_exit = outer_exit;
+    c->freereg = save;
+}
+
+/* Returns the register of a local of an inlined body; a local that is not
+   an argument is first filled from the caller if it is still unset. */
+static int compile_arg(Compiler *c, Node *n) {
+    const Node *inl = n->u.arg.inl;
+    int r = inl->u.inl.reg + n->u.arg.index;
+    if (n->u.arg.index >= inl->u.inl.arg_count) emit_bx(c, OP_FILL, r, (uint32_t)n->u.arg.name->id);
+    return r;
+}
+
+/* A loop invariant lives in a register its loop reserves and clears on
+   entry; the first use computes it there, and later uses find a number
+   and skip the computation. */
+static int compile_cached(Compiler *c, Node *n) {
+    int r = n->u.cached.reg;
+    int skip = emit(c, OP_JMPNUM, 0, r, 0, 0);
+    compile_expr_to(c, n->u.cached.expr, r);
+    jump_set(c, skip, (uint32_t)c->p->ncode);
+    return r;
+}
+
+/* Reserves and clears the registers of a loop's invariants. */
+static void cache_regs(Compiler *c, Node *cached) {
+    for (; cached; cached = cached->next) {
+        cached->u.cached.reg = alloc_reg(c);
+        emit_bx(c, OP_LOADK, cached->u.cached.reg, add_const(c, NONE_VAL));
+    }
+}
+
+/* Returns a register, or a constant index with *is_k set, holding n's value
+   without copying locals or constants into temporaries. */
+static int compile_operand(Compiler *c, Node *n, int *is_k) {
+    *is_k = 0;
+    if (n->type == N_EXPR_NUMBER || n->type == N_EXPR_STRING) {
+        int idx = n->type == N_EXPR_NUMBER ? num_const(c, n->u.number) : add_const(c, n->u.string);
+        if (idx <= MAX_REGS) { *is_k = 1; return idx; }
+    } else if (n->type == N_EXPR_VAR) {
+        int slot = n->u.var.name->slot;
+        if (slot >= 0 && c->da[slot]) return slot;
+    } else if (n->type == N_EXPR_CALL) {
+        return compile_call(c, n, OP_CALL);
+    } else if (n->type == N_EXPR_CACHED) {
+        return compile_cached(c, n);
+    } else if (n->type == N_EXPR_ARG) {
+        return compile_arg(c, n);
+    }
+    int r = alloc_reg(c);
+    compile_expr_to(c, n, r);
+    return r;
+}
+
+static int compile_jump(Compiler *c, Node *n, int when, OpCode test);
+
+static void compile_expr_to(Compiler *c, Node *n, int dst) {
+    int save = c->freereg;
+    switch (n->type) {
+        case N_EXPR_NUMBER: emit_bx(c, OP_LOADK, dst, num_const(c, n->u.number)); break;
+        case N_EXPR_STRING: emit_bx(c, OP_LOADK, dst, add_const(c, n->u.string)); break;
+        case N_EXPR_VAR: {
+            int slot = n->u.var.name->slot;
+            if (slot < 0) emit_bx(c, OP_GETDYN, dst, (uint32_t)n->u.var.name->id);
+            else if (!c->da[slot]) emit(c, OP_GETCHK, 0, dst, slot, 0);
+            else if (slot != dst) emit(c, OP_MOVE, 0, dst, slot, 0);
+            break;
+        }
+        case N_EXPR_CALL: {
+            int base = compile_call(c, n, OP_CALL);
+            if (base != dst) emit(c, OP_MOVE, 0, dst, base, 0);
+            break;
+        }
+        case N_EXPR_BINARY: {
+            int kb, kc;
+            int b = compile_operand(c, n->u.bin.left, &kb);
+            int cc = compile_operand(c, n->u.bin.right, &kc);
+            emit(c, binary_opcode((BinOp)n->op), (kb ? KB : 0) | (kc ? KC : 0), dst, b, cc);
+            break;
+        }
+        case N_EXPR_CACHED: {
+            int r = compile_cached(c, n);
+            if (r != dst) emit(c, OP_MOVE, 0, dst, r, 0);
+            break;
+        }
+        case N_EXPR_IV: compile_expr_to(c, n->u.iv.expr, dst); break;
+        case N_EXPR_INLINE: compile_inline(c, n, dst); break;
+        case N_EXPR_ARG: {
+            int r = compile_arg(c, n);
+            if (r != dst) emit(c, OP_MOVE, 0, dst, r, 0);
+            break;
+        }
+        case N_EXPR_AND: case N_EXPR_OR: case N_EXPR_NOT: {
+            /* dst is written only after every operand has been tested */
+            int jfalse = compile_jump(c, n, 0, OP_TESTNUM);
+            emit_bx(c, OP_LOADK, dst, num_const(c, 1.0));
+            int jend = emit_jump(c);
+            patch_jump(c, jfalse);
+            emit_bx(c, OP_LOADK, dst, num_const(c, 0.0));
+            patch_jump(c, jend);
+            break;
+        }
+        default: break;
+    }
+    c->freereg = save;
+}
 
-            /* ---- Execute function body ---- */
-            int func_returned = 0;
-            Value func_return_value = {VAL_NONE, 0, NULL};
-            Value func_result = eval_stmt(f->body, &func_returned, &func_return_value);
+/* set x to x + a + b ...: one ADD x, x, operand per operand, which the VM
+   turns into in-place appends when x holds an unshared string. */
+static void compile_append(Compiler *c, Node *e, int slot) {
+    if (e->u.bin.left->type == N_EXPR_BINARY) compile_append(c, e->u.bin.left, slot);
+    int save = c->freereg, k;
+    int r = compile_operand(c, e->u.bin.right, &k);
+    emit(c, OP_ADD, k ? KC : 0, slot, slot, r);
+    c->freereg = save;
+}
 
-            /* ---- Clean up scope ---- */
-            pop_scope();
+/* Emits the test of condition n and returns the list of JMPs taken when its
+   truth equals `when`; otherwise control falls through.  A plain condition
+   is tested with `test`, which decides how a non-numeric value fails; the
+   operands of and, or and not go through OP_TESTNUM.  Each operand is
+   tested once and the right side of and/or is skipped once the left side
+   decides. */
+static int compile_jump(Compiler *c, Node *n, int when, OpCode test) {
+    int save = c->freereg, kb, kc;
+    if (n->type == N_EXPR_NOT) return compile_jump(c, n->u.expr, !when, OP_TESTNUM);
+    if (n->type == N_EXPR_AND || n->type == N_EXPR_OR) {
+        int decides = n->type == N_EXPR_OR;   /* the left truth that settles the result */
+        if (when == decides) {
+            int l = compile_jump(c, n->u.bin.left, when, OP_TESTNUM);
+            return jump_concat(c, l, compile_jump(c, n->u.bin.right, when, OP_TESTNUM));
+        }
+        int settled = compile_jump(c, n->u.bin.left, decides, OP_TESTNUM);
+        int l = compile_jump(c, n->u.bin.right, when, OP_TESTNUM);
+        patch_jump(c, settled);
+        return l;
+    }
+    if (n->type == N_EXPR_BINARY && is_compare((BinOp)n->op)) {
+        int b = compile_operand(c, n->u.bin.left, &kb);
+        int cc = compile_operand(c, n->u.bin.right, &kc);
+        OpCode op = (OpCode)(OP_IFEQ + (n->op - BIN_EQ));
+        emit(c, op, (kb ? KB : 0) | (kc ? KC : 0), 0, b, cc);
+    } else {
+        int b = compile_operand(c, n, &kb);
+        emit(c, test, kb ? KB : 0, 0, b, 0);
+    }
+    c->freereg = save;
+    /* a test skips one JMP when true; to jump on true, that JMP skips the list's */
+    if (when) emit_bx(c, OP_JMP, 0, (uint32_t)c->p->ncode + 2);
+    return emit_jump(c);
+}
 
-            /* ---- NOW safe to free argument values ---- */
-            for (int i = 0; i < f->param_count; i++) {
-                value_free(&arg_values[i]);
+static void compile_stmt(Compiler *c, Node *n) {
+    Proto *p = c->p;
+    switch (n->type) {
+        case N_STMT_LIST:
+            for (Node *s = n->u.list; s; s = s->next) compile_stmt(c, s);
+            break;
+        case N_STMT_SET: {
+            int slot = n->u.set.name->slot;
+            if (c->da[slot] && is_append_chain(n->u.set.expr, n->u.set.name)) compile_append(c, n->u.set.expr, slot);
+            else compile_expr_to(c, n->u.set.expr, slot);
+            da_set(c, slot);
+            break;
+        }
+        case N_STMT_SET_ARG: {
+            const Node *arg = n->u.set_arg.arg;
+            compile_expr_to(c, n->u.set_arg.expr, arg->u.arg.inl->u.inl.reg + arg->u.arg.index);
+            break;
+        }
+        case N_STMT_PRINT: {
+            int save = c->freereg, k;
+            int b = compile_operand(c, n->u.expr, &k);
+            emit(c, OP_PRINT, k ? KB : 0, 0, b, 0);
+            c->freereg = save;
+            break;
+        }
+        case N_STMT_READ: {
+            int slot = n->u.var.name->slot;
+            emit(c, OP_READ, 0, slot, 0, 0);
+            da_set(c, slot);
+            break;
+        }
+        case N_STMT_IF: {
+            int jelse = compile_jump(c, n->u.cond.cond, 0, OP_TESTIF);
+            int mark = c->ntrail;
+            compile_stmt(c, n->u.cond.body);
+            if (!n->u.cond.else_body) {
+                da_undo(c, mark);
+                patch_jump(c, jelse);
+                break;
             }
-            free(arg_values);
-
-            /* ---- Return result ---- */
-            Value final_result;
-            if (func_returned) {
-                final_result = value_dup(&func_return_value);
-                value_free(&func_result);
-                value_free(&func_return_value);
-            } else {
-                final_result = func_result;
+            int jend = emit_jump(c);
+            patch_jump(c, jelse);
+            /* after the if, a local is assigned only if both branches assign it */
+            int nthen = c->ntrail - mark;
+            int *then_slots = malloc((nthen + 1) * sizeof(int));
+            memcpy(then_slots, c->trail + mark, nthen * sizeof(int));
+            da_undo(c, mark);
+            compile_stmt(c, n->u.cond.else_body);
+            int nelse = c->ntrail - mark;
+            int *else_slots = malloc((nelse + 1) * sizeof(int));
+            memcpy(else_slots, c->trail + mark, nelse * sizeof(int));
+            da_undo(c, mark);
+            for (int i = 0; i < nthen; i++) c->da[then_slots[i]] = 2;
+            for (int i = 0; i < nelse; i++) {
+                if (c->da[else_slots[i]] == 2) { c->da[else_slots[i]] = 0; da_set(c, else_slots[i]); }
+            }
+            for (int i = 0; i < nthen; i++) if (c->da[then_slots[i]] == 2) c->da[then_slots[i]] = 0;
+            free(then_slots);
+            free(else_slots);
+            patch_jump(c, jend);
+            break;
+        }
+        case N_STMT_WHILE: {
+            int save = c->freereg;
+            cache_regs(c, n->u.cond.cached);
+            int top = p->ncode;
+            int jexit = compile_jump(c, n->u.cond.cond, 0, OP_TESTWHILE);
+            int mark = c->ntrail, brk = c->brk, cont = c->cont;
+            c->brk = -1;
+            c->cont = top;
+            compile_stmt(c, n->u.cond.body);
+            da_undo(c, mark);
+            emit_bx(c, OP_JMP, 0, (uint32_t)top);
+            patch_jump(c, jexit);
+            if (c->brk >= 0) patch_jump(c, c->brk);
+            c->brk = brk;
+            c->cont = cont;
+            c->freereg = save;
+            break;
+        }
+        case N_STMT_FOR: {
+            int save = c->freereg;
+            int base = alloc_reg(c);
+            for (int i = 1; i < 5; i++) alloc_reg(c);
+            compile_expr_to(c, n->u.loop.from, base);
+            compile_expr_to(c, n->u.loop.to, base + 1);
+            if (n->u.loop.step) compile_expr_to(c, n->u.loop.step, base + 2);
+            else emit_bx(c, OP_LOADK, base + 2, num_const(c, 1.0));
+            emit(c, OP_FORPREP, 0, base, 0, 0);
+            cache_regs(c, n->u.loop.cached);
+            int slot = n->u.loop.var->slot;
+            int top = emit(c, OP_FORITER, 0, base, slot, 0);
+            int jexit = emit_jump(c);
+            int mark = c->ntrail, brk = c->brk, cont = c->cont;
+            c->brk = -1;
+            c->cont = top;
+            da_set(c, slot);
+            compile_stmt(c, n->u.loop.body);
+            da_undo(c, mark);
+            emit_bx(c, OP_JMP, 0, (uint32_t)top);
+            patch_jump(c, jexit);
+            if (c->brk >= 0) patch_jump(c, c->brk);
+            c->brk = brk;
+            c->cont = cont;
+            c->freereg = save;
+            break;
+        }
+        case N_STMT_MATCH: {
+            /* OP_MATCH, then a jump table: the else part and one JMP per case */
+            int save = c->freereg, k, ncases = n->u.match.ncases;
+            int b = compile_operand(c, n->u.match.subject, &k);
+            c->freereg = save;
+            if (p->nmatches > MAX_REGS) { fprintf(stderr, "Error: too many match statements\n"); exit(1); }
+            p->matches = grow_array(p->matches, &p->matches_cap, p->nmatches + 1, sizeof(MatchTable*));
+            p->matches[p->nmatches] = n->u.match.table;
+            emit(c, OP_MATCH, k ? KB : 0, 0, b, p->nmatches++);
+            int table = p->ncode, jend = -1;
+            for (int i = 0; i <= ncases; i++) emit_jump(c);
+            for (int i = 0; i <= ncases; i++) {
+                Node *body = i ? n->u.match.bodies[i - 1] : n->u.match.else_body;
+                jump_set(c, table + i, (uint32_t)p->ncode);
+                int mark = c->ntrail;
+                if (body) compile_stmt(c, body);
+                da_undo(c, mark);
+                if (i < ncases) jend = jump_push(c, jend, emit_jump(c));
+            }
+            if (jend >= 0) patch_jump(c, jend);
+            break;
+        }
+        case N_STMT_BREAK: {
+            c->brk = jump_push(c, c->brk, emit_jump(c));
+            break;
+        }
+        case N_STMT_CONTINUE: emit_bx(c, OP_JMP, 0, (uint32_t)c->cont); break;
+        case N_STMT_FUNCDEF: {
+            p->protos = grow_array(p->protos, &p->protos_cap, p->nprotos + 1, sizeof(Proto*));
+            c->defs = realloc(c->defs, p->protos_cap * sizeof(Node*));
+            p->protos[p->nprotos] = NULL;
+            c->defs[c->ndefs++] = n;
+            emit_bx(c, OP_FUNCDEF, 0, (uint32_t)p->nprotos++);
+            break;
+        }
+        case N_STMT_RETURN: {
+            int save = c->freereg, k = 1, b;
+            if (c->inlining) {
+                if (n->u.expr) compile_expr_to(c, n->u.expr, c->inl_dst);
+                else emit_bx(c, OP_LOADK, c->inl_dst, num_const(c, 0.0));
+                c->inl_exit = jump_push(c, c->inl_exit, emit_jump(c));
+                break;
+            }
+            if (n->u.expr && n->u.expr->tail) {
+                compile_call(c, n->u.expr, OP_TAILCALL);
+                c->freereg = save;
+                break;
             }
+            if (n->u.expr) b = compile_operand(c, n->u.expr, &k);
+            else if ((b = num_const(c, 0.0)) > MAX_REGS) {
+                int r = alloc_reg(c);
+                emit_bx(c, OP_LOADK, r, (uint32_t)b);
+                b = r;
+                k = 0;
+            }
+            emit(c, OP_RET, k ? KB : 0, 0, b, 0);
+            c->freereg = save;
+            break;
+        }
+        default: break;
+    }
+}
 
-            return final_result;
+static Proto *compile_proto(Node *body, Symbol *name, Symbol **params, int nparams, Node *def) {
+    Proto *p = calloc(1, sizeof(Proto));
+    p->name = name;
+    p->def = def;
+    p->nparams = nparams;
+    Compiler c = {0};
+    c.p = p;
+    for (int i = 0; i < nparams; i++) add_local(&c, params[i], 1);
+    collect_locals(&c, body);
+    if (p->nlocals > MAX_REGS) {
+        fprintf(stderr, "Error: %s is too large to compile\n", name ? name->name : "program");
+        exit(1);
+    }
+    c.da = calloc(p->nlocals + 1, 1);
+    c.trail = malloc((p->nlocals + 1) * sizeof(int));
+    for (int i = 0; i < nparams; i++) c.da[i] = 1;
+    c.freereg = p->nregs = p->nlocals;
+    if (def && def->u.func.memo) {
+        p->memo_key = c.freereg;
+        for (int i = 0; i < nparams; i++) alloc_reg(&c);
+    }
+    compile_stmt(&c, body);
+    emit(&c, OP_RETNONE, 0, 0, 0, 0);
+    for (int i = p->nlocals - 1; i >= 0; i--) p->locals[i]->slot = c.saved_slots[i];
+    /* nested bodies do not see this one's locals, so compile them after */
+    for (int i = 0; i < c.ndefs; i++) {
+        Node *d = c.defs[i];
+        p->protos[i] = compile_proto(d->u.func.body, d->u.func.name, d->u.func.params, d->u.func.param_count, d);
+    }
+    free(c.da);
+    free(c.trail);
+    free(c.saved_slots);
+    free(c.defs);
+    free(c.consts.e);
+    return p;
+}
+
+static void proto_free(Proto *p) {
+    for (int i = 0; i < p->nprotos; i++) proto_free(p->protos[i]);
+    free(p->protos);
+    free(p->locals);
+    free(p->code);
+    free(p->k);
+    free(p->calls);
+    free(p->matches);
+    free(p);
+}
+
+/* ---------- Virtual Machine ---------- */
+typedef struct {
+    Proto *proto;
+    const Instr *pc; // resume point while a callee runs
+    int base;        // first register in vm.stack
+} CallFrame;
+
+static struct {
+    Value *stack; int stack_cap;
+    CallFrame *frames; int nframes, frames_cap;
+} vm;
+
+static void vm_reserve(int n) {
+    int old = vm.stack_cap;
+    vm.stack = grow_array(vm.stack, &vm.stack_cap, n, sizeof(Value));
+    for (int i = old; i < vm.stack_cap; i++) vm.stack[i] = UNSET_VAL;
+}
+
+static void reg_unset(Value *r) {
+    if (is_heap_str(*r)) str_release(val_str(*r));
+    *r = UNSET_VAL;
+}
+
+static inline void reg_num(Value *r, double d) {
+    if (is_heap_str(*r)) str_release(val_str(*r));
+    *r = num_val(d);
+}
+
+static void reg_copy(Value *r, const Value *v) {
+    if (r == v) return;
+    Value nv = value_dup(v);
+    value_free(r);
+    *r = nv;
+}
+
+/* Slow path of the arithmetic opcodes: concatenation and type errors. */
+static void reg_binary(Value *r, BinOp op, const Value *l, const Value *rv) {
+    if (op == BIN_ADD && r == l && str_append(r, rv)) return;   /* set s to s + x */
+    Value res = binary_op(op, l, rv);
+    value_free(r);
+    *r = res;
+}
+
+/* var_get for the VM: the innermost binding of name in frames top..0. */
+static Value *vm_lookup(int top, const Symbol *name) {
+    for (int f = top; f >= 0; f--) {
+        Proto *p = vm.frames[f].proto;
+        for (int s = p->nlocals - 1; s >= 0; s--) {
+            if (p->locals[s] != name) continue;
+            Value *v = &vm.stack[vm.frames[f].base + s];
+            if (!is_unset(*v)) return v;
+            break;
         }
-        case N_EXPR_BINARY: {
-            Value l = eval_expr(n->left);
-            Value r = eval_expr(n->right);
-            if (n->number == T_PLUS && (l.type == VAL_STR || r.type == VAL_STR)) {
-                char lbuf[64], rbuf[64];
-                const char *lstr = l.type == VAL_STR ? (l.str ? l.str : "") : (sprintf(lbuf, "%g", l.num), lbuf);
-                const char *rstr = r.type == VAL_STR ? (r.str ? r.str : "") : (sprintf(rbuf, "%g", r.num), rbuf);
-                size_t len = strlen(lstr) + strlen(rstr) + 1;
-                char *res = malloc(len);
-                strcpy(res, lstr);
-                strcat(res, rstr);
-                value_free(&l);
-                value_free(&r);
-                return (Value){VAL_STR, 0, res};
+    }
+    fprintf(stderr, "Error: Undefined variable %s\n", name->name);
+    exit(1);
+}
+
+#define RKB(i) (((i).k & KB) ? &K[(i).b] : &R[(i).b])
+#define RKC(i) (((i).k & KC) ? &K[(i).c] : &R[(i).c])
+#define JUMP_NEXT() (pc = p->code + INSTR_BX(*pc))
+
+#define VM_ARITH(OPC, BOP, EXPR) case OPC: { \
+        const Value *l = RKB(i), *r = RKC(i); \
+        if (is_num(*l) && is_num(*r)) reg_num(&R[i.a], EXPR); \
+        else reg_binary(&R[i.a], BOP, l, r); \
+        break; \
+    }
+#define VM_COMPARE(OPC, BOP, CMP) case OPC: { \
+        const Value *l = RKB(i), *r = RKC(i); \
+        if (!is_num(*l) || !is_num(*r)) binary_op(BOP, l, r); /* reports the error */ \
+        reg_num(&R[i.a], val_num(*l) CMP val_num(*r) ? 1 : 0); \
+        break; \
+    }
+#define VM_IF(OPC, BOP, CMP) case OPC: { \
+        const Value *l = RKB(i), *r = RKC(i); \
+        if (!is_num(*l) || !is_num(*r)) binary_op(BOP, l, r); /* reports the error */ \
+        if (val_num(*l) CMP val_num(*r)) pc++; else JUMP_NEXT(); \
+        break; \
+    }
+
+static void vm_run(Proto *main_proto) {
+    vm_reserve(main_proto->nregs);
+    vm.frames = grow_array(vm.frames, &vm.frames_cap, 1, sizeof(CallFrame));
+    vm.frames[0] = (CallFrame){main_proto, NULL, 0};
+    vm.nframes = 1;
+
+    Proto *p = main_proto;
+    const Instr *pc = p->code;
+    Value *R = vm.stack;
+    const Value *K = p->k;
+    for (;;) {
+        Instr i = *pc++;
+        switch ((OpCode)i.op) {
+            case OP_LOADK: reg_copy(&R[i.a], &K[INSTR_BX(i)]); break;
+            case OP_MOVE: reg_copy(&R[i.a], &R[i.b]); break;
+            case OP_GETCHK: {
+                Value *v = &R[i.b];
+                if (is_unset(*v)) v = vm_lookup(vm.nframes - 2, p->locals[i.b]);
+                reg_copy(&R[i.a], v);
+                break;
             }
-            if (l.type != VAL_NUM || r.type != VAL_NUM) {
-                fprintf(stderr, "Error: Numeric operation on non-numeric types\n");
-                value_free(&l);
-                value_free(&r);
-                exit(1);
+            case OP_GETDYN: reg_copy(&R[i.a], vm_lookup(vm.nframes - 2, symtab.by_id[INSTR_BX(i)])); break;
+            case OP_FILL:
+                if (is_unset(R[i.a])) reg_copy(&R[i.a], vm_lookup(vm.nframes - 1, symtab.by_id[INSTR_BX(i)]));
+                break;
+            VM_ARITH(OP_ADD, BIN_ADD, val_num(*l) + val_num(*r))
+            VM_ARITH(OP_SUB, BIN_SUB, val_num(*l) - val_num(*r))
+            VM_ARITH(OP_MUL, BIN_MUL, val_num(*l) * val_num(*r))
+            case OP_DIV: {
+                const Value *l = RKB(i), *r = RKC(i);
+                if (is_num(*l) && is_num(*r) && val_num(*r) != 0) reg_num(&R[i.a], val_num(*l) / val_num(*r));
+                else reg_binary(&R[i.a], BIN_DIV, l, r);
+                break;
             }
-            Value result;
-            switch ((TokenType)(int)n->number) {
-                case T_PLUS: result = (Value){VAL_NUM, l.num + r.num, NULL}; break;
-                case T_MINUS: result = (Value){VAL_NUM, l.num - r.num, NULL}; break;
-                case T_MUL: result = (Value){VAL_NUM, l.num * r.num, NULL}; break;
-                case T_DIV: {
-                    if (r.num == 0) { fprintf(stderr, "Error: Division by zero\n"); exit(1); }
-                    result = (Value){VAL_NUM, l.num / r.num, NULL};
-                    break;
+            VM_ARITH(OP_MOD, BIN_MOD, num_mod(val_num(*l), val_num(*r)))
+            VM_COMPARE(OP_EQ, BIN_EQ, ==)
+            VM_COMPARE(OP_NEQ, BIN_NEQ, !=)
+            VM_COMPARE(OP_LT, BIN_LT, <)
+            VM_COMPARE(OP_LE, BIN_LE, <=)
+            VM_COMPARE(OP_GT, BIN_GT, >)
+            VM_COMPARE(OP_GE, BIN_GE, >=)
+            VM_IF(OP_IFEQ, BIN_EQ, ==)
+            VM_IF(OP_IFNEQ, BIN_NEQ, !=)
+            VM_IF(OP_IFLT, BIN_LT, <)
+            VM_IF(OP_IFLE, BIN_LE, <=)
+            VM_IF(OP_IFGT, BIN_GT, >)
+            VM_IF(OP_IFGE, BIN_GE, >=)
+            case OP_TESTIF: {
+                const Value *v = RKB(i);
+                if (!is_num(*v)) {
+                    fprintf(stderr, "Error: Condition must be numeric\n");
+                    exit(1);
                 }
-                case T_MOD: result = (Value){VAL_NUM, fmod(l.num, r.num), NULL}; break;
-                case T_EQ: result = (Value){VAL_NUM, l.num == r.num ? 1 : 0, NULL}; break;
-                case T_NEQ: result = (Value){VAL_NUM, l.num != r.num ? 1 : 0, NULL}; break;
-                case T_GT: result = (Value){VAL_NUM, l.num > r.num ? 1 : 0, NULL}; break;
-                case T_LT: result = (Value){VAL_NUM, l.num < r.num ? 1 : 0, NULL}; break;
-                case T_LE: result = (Value){VAL_NUM, l.num <= r.num ? 1 : 0, NULL}; break;
-                case T_GE: result = (Value){VAL_NUM, l.num >= r.num ? 1 : 0, NULL}; break;
-                case T_AND: result = (Value){VAL_NUM, (l.num != 0.0 && r.num != 0.0) ? 1.0 : 0.0, NULL}; break;
-                default: result = (Value){VAL_NONE, 0, NULL}; break;
+                if (val_num(*v) != 0.0) pc++; else JUMP_NEXT();
+                break;
+            }
+            case OP_TESTWHILE: {
+                const Value *v = RKB(i);
+                if (is_num(*v) && val_num(*v) != 0.0) pc++; else JUMP_NEXT();
+                break;
+            }
+            case OP_TESTNUM: if (truth(RKB(i))) pc++; else JUMP_NEXT(); break;
+            case OP_JMP: pc = p->code + INSTR_BX(i); break;
+            case OP_JMPNUM: if (is_num(R[i.a])) pc = p->code + INSTR_BX(i); break;
+            case OP_MATCH: pc += match_find(p->matches[i.c], RKB(i)) + 1; break;
+            case OP_FORPREP: {
+                Value *f = &R[i.a];
+                double start, end, step;
+                long iters = for_prepare(&f[0], &f[1], &f[2], &start, &end, &step);
+                reg_num(&f[0], start);
+                reg_num(&f[1], end);
+                reg_num(&f[2], step);
+                reg_num(&f[3], (double)iters);
+                reg_num(&f[4], 0);
+                break;
+            }
+            case OP_FORITER: {
+                Value *f = &R[i.a];
+                long iter = (long)val_num(f[4]);
+                if (iter < (long)val_num(f[3])) {
+                    double step = val_num(f[2]), current = val_num(f[0]) + iter * step;
+                    /* final safeguard – clamp to the exact bound */
+                    if (!((step > 0.0 && current > val_num(f[1]) + 1e-9) ||
+                          (step < 0.0 && current < val_num(f[1]) - 1e-9))) {
+                        f[4] = num_val((double)(iter + 1));
+                        reg_num(&R[i.b], current);
+                        pc++;
+                        break;
+                    }
+                }
+                JUMP_NEXT();
+                break;
+            }
+            case OP_PRINT: print_value(RKB(i)); break;
+            case OP_READ: {
+                Value v = read_value();
+                value_free(&R[i.a]);
+                R[i.a] = v;
+                break;
+            }
+            case OP_FUNCDEF: {
+                Proto *fp = p->protos[INSTR_BX(i)];
+                FuncDef *f = func_set(fp->def);
+                f->proto = fp;
+                fp->memo = f->memo;
+                break;
+            }
+            case OP_FCHECK: {
+                CallSite *cs = &p->calls[INSTR_BX(i)];
+                if (cs->fn) break;
+                FuncDef *f = func_get(cs->name);
+                if (!f) {
+                    fprintf(stderr, "Error: Undefined function %s\n", cs->name->name);
+                    exit(1);
+                }
+                if (f->param_count != cs->argc) {
+                    fprintf(stderr, "Error: Function %s expects %d args, got %d\n",
+                            cs->name->name, f->param_count, cs->argc);
+                    exit(1);
+                }
+                cs->fn = f;
+                break;
+            }
+            case OP_CALL: {
+                Proto *callee = p->calls[INSTR_BX(i)].fn->proto;
+                int base = vm.frames[vm.nframes - 1].base + i.a;
+                if (callee->memo) {
+                    const Value *hit = memo_find(callee->memo, &R[i.a]);
+                    if (hit) {
+                        for (int r = 1; r < callee->nparams; r++) reg_unset(&R[i.a + r]);
+                        Value v = value_dup(hit);
+                        reg_unset(&R[i.a]);
+                        R[i.a] = v;
+                        break;
+                    }
+                }
+                vm_reserve(base + callee->nregs);
+                /* locals start unbound; the arguments already are the parameters */
+                for (int r = callee->nparams; r < callee->nlocals; r++) reg_unset(&vm.stack[base + r]);
+                if (callee->memo)
+                    for (int r = 0; r < callee->nparams; r++) {
+                        reg_unset(&vm.stack[base + callee->memo_key + r]);
+                        vm.stack[base + callee->memo_key + r] = value_dup(&vm.stack[base + r]);
+                    }
+                vm.frames[vm.nframes - 1].pc = pc;
+                check_depth(vm.nframes);   /* frame 0 is the main program */
+                vm.frames = grow_array(vm.frames, &vm.frames_cap, vm.nframes + 1, sizeof(CallFrame));
+                vm.frames[vm.nframes++] = (CallFrame){callee, NULL, base};
+                p = callee;
+                pc = p->code;
+                R = vm.stack + base;
+                K = p->k;
+                break;
+            }
+            case OP_TAILCALL:
+                /* other locals keep their values, as in the tree walker */
+                for (int r = 0; r < p->nparams; r++) {
+                    reg_unset(&R[r]);
+                    R[r] = R[i.a + r];
+                    R[i.a + r] = UNSET_VAL;
+                }
+                pc = p->code;
+                break;
+            case OP_RET:
+            case OP_RETNONE: {
+                Value result = NONE_VAL;
+                if (i.op == OP_RET && (i.k & KB)) result = value_dup(&K[i.b]);
+                else if (i.op == OP_RET) { result = R[i.b]; R[i.b] = UNSET_VAL; }
+                if (p->memo) memo_store(p->memo, &R[p->memo_key], &result);
+                for (int r = 0; r < p->nregs; r++) reg_unset(&R[r]);
+                if (--vm.nframes == 0) {
+                    value_free(&result);  /* the main program finished */
+                    return;
+                }
+                reg_unset(&R[0]);         /* the caller's call register, which a */
+                R[0] = result;            /* callee without registers never cleared */
+                CallFrame *fr = &vm.frames[vm.nframes - 1];
+                p = fr->proto;
+                pc = fr->pc;
+                R = vm.stack + fr->base;
+                K = p->k;
+                break;
             }
-            value_free(&l);
-            value_free(&r);
-            return result;
         }
-        default: return (Value){VAL_NONE, 0, NULL};
     }
 }
 
-/* ---------- Memory Cleanup ---------- */
-static void free_node(Node *n) {
-    if (!n) return;
-    if (n->name) free(n->name);
-    if (n->string) free(n->string);
-    if (n->var) free(n->var);
-    if (n->params) {
-        for (int i = 0; i < n->param_count; i++) free(n->params[i]);
-        free(n->params);
-    }
-    if (n->args) {
-        for (int i = 0; i < n->arg_count; i++) free_node(n->args[i]);
-        free(n->args);
-    }
-    free_node(n->left);
-    free_node(n->right);
-    free_node(n->cond);
-    free_node(n->body);
-    free_node(n->else_body);
-    free_node(n->from_expr);
-    free_node(n->to_expr);
-    free_node(n->step_expr);
-    free_node(n->next);
-    free(n);
+static void vm_free(void) {
+    for (int i = 0; i < vm.stack_cap; i++) value_free(&vm.stack[i]);
+    free(vm.stack);
+    free(vm.frames);
+    vm.stack = NULL; vm.stack_cap = 0;
+    vm.frames = NULL; vm.nframes = vm.frames_cap = 0;
 }
 
+/* ---------- Memory Cleanup ---------- */
 static void free_func_table() {
     for (int i = 0; i < func_table.func_count; i++) {
         FuncDef *f = func_table.funcs[i];
-        free(f->name);
-        for (int j = 0; j < f->param_count; j++) free(f->params[j]);
-        free(f->params);
-        free_node(f->body);
+        /* params and body belong to the N_STMT_FUNCDEF node, freed with the AST */
+        if (f->memo) memo_free(f->memo);
         free(f);
     }
     free(func_table.funcs);
+    func_table.funcs = NULL;
+    func_table.func_count = func_table.func_cap = 0;
+}
+
+/* Errors end the run with exit(1) from deep inside either engine.  A heap
+   string is reachable only through a NaN-boxed Value, which leak checkers
+   cannot follow, so the stores of values are released on the way out too;
+   after a normal run they are already empty. */
+static void release_values(void) {
+    free_func_table();
+    globals_free();
+    vm_free();
+}
+
+/* ---------- Lexer Benchmark ---------- */
+/* --lex-bench: lexes the whole file repeatedly for about a second and
+   reports throughput, for tuning next_token. */
+static void lex_benchmark(const char *src) {
+    long tokens = 0;
+    int passes = 0;
+    clock_t start = clock(), elapsed;
+    do {
+        Lexer lx = {.src = src, .pos = 0, .line = 1};
+        while (next_token(&lx).type != T_EOF) tokens++;
+        passes++;
+        elapsed = clock() - start;
+    } while (elapsed < CLOCKS_PER_SEC);
+    double secs = (double)elapsed / CLOCKS_PER_SEC;
+    printf("%ld tokens in %d passes, %.3f s: %.2f M tokens/s\n",
+           tokens, passes, secs, tokens / secs / 1e6);
+}
+
+/* --mem-report: what the parsed program occupies and how many strings the
+   run created, printed to stderr. */
+static void mem_report(const Arena *a) {
+    size_t reserved = 0;
+    int blocks = 0;
+    for (const ArenaBlock *b = a->head; b; b = b->next, blocks++) reserved += sizeof(ArenaBlock) + b->cap;
+    fprintf(stderr, "ast: %zu nodes in %zu bytes (%.1f bytes/node)\n", node_stats.count, node_stats.bytes,
+            node_stats.count ? (double)node_stats.bytes / node_stats.count : 0.0);
+    fprintf(stderr, "arena: %zu bytes used, %zu reserved in %d blocks\n", a->used, reserved, blocks);
+    fprintf(stderr, "strings: %zu heap-allocated, %zu inline\n", str_stats.heap, str_stats.inlined);
+}
+
+/* --stats: how often each memo function's cache answered a call, printed to stderr. */
+static void stats_report(void) {
+    for (int i = 0; i < func_table.func_count; i++) {
+        const FuncDef *f = func_table.funcs[i];
+        if (!f->memo) continue;
+        fprintf(stderr, "memo %s: %zu hits, %zu misses, %zu evictions\n",
+                f->name->name, f->memo->hits, f->memo->misses, f->memo->evictions);
+    }
 }
 
 /* ---------- Main ---------- */
 int main(int argc, char **argv) {
-    if (argc < 2) { 
-        fprintf(stderr, "Usage: %s file.elang\n", argv[0]); 
+    const char *path = NULL;
+    int use_vm = 0, bench_lexer = 0, report_mem = 0, report_stats = 0, optimize = 0;
+    sym_else = intern("else", 4);
+    sym_step = intern("step", 4);
+    sym_memo = intern("memo", 4);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--engine=vm") == 0) use_vm = 1;
+        else if (strcmp(argv[i], "--lex-bench") == 0) bench_lexer = 1;
+        else if (strcmp(argv[i], "--mem-report") == 0) report_mem = 1;
+        else if (strcmp(argv[i], "--stats") == 0) report_stats = 1;
+        else if (strcmp(argv[i], "-O") == 0) optimize = 1;
+        else if (strncmp(argv[i], "--max-depth=", 12) == 0 && atoi(argv[i] + 12) > 0) max_depth = atoi(argv[i] + 12);
+        else if (strcmp(argv[i], "--engine=ast") == 0) use_vm = 0;
+        else if (!path && argv[i][0] != '-') path = argv[i];
+        else { path = NULL; break; }
+    }
+    if (!path) { 
+        fprintf(stderr, "Usage: %s [--engine=ast|vm] [--lex-bench] [--mem-report] [--stats] [--max-depth=N] [-O] file.elang\n", argv[0]); 
         return 1; 
     }
 
-    FILE *f = fopen(argv[1], "rb");
+    FILE *f = fopen(path, "rb");
     if (!f) { perror("fopen"); return 1; }
 
     fseek(f, 0, SEEK_END);
@@ -1085,23 +3908,43 @@ int main(int argc, char **argv) {
     src[sz] = '\0';
     fclose(f);
 
-    Parser p = {.lx = {.src = src, .pos = 0, .line = 1}};
-    push_scope();
+    if (bench_lexer) {
+        lex_benchmark(src);
+        free(src);
+        symtab_free();
+        return 0;
+    }
+
+    atexit(release_values);
+    Arena arena = {NULL};
+    Parser p = {.lx = {.src = src, .pos = 0, .line = 1}, .arena = &arena};
     advance(&p);
 
     Node *ast = parse_statements(&p);
+    free(p.scratch);
+    fold(&arena, ast);
+    resolve_program(ast, &arena);
+    if (optimize) {
+        inline_program(&arena, ast);
+        optimize_loops(&arena, ast);
+    }
 
-    int returned = 0;
-    Value return_val = (Value){VAL_NONE, 0, NULL};
-
-    /* Execute — ignore any return value */
-    eval_stmt(ast, &returned, &return_val);
+    if (use_vm) {
+        Proto *prog = compile_proto(ast, NULL, NULL, 0, NULL);
+        vm_run(prog);
+        vm_free();
+        proto_free(prog);
+    } else {
+        eval_program(ast);
+    }
+    if (report_mem) mem_report(&arena);
+    if (report_stats) stats_report();
 
-    value_free(&return_val);
-    free_node(ast);
     free_func_table();
-    while (current_scope) pop_scope();
+    globals_free();         /* variables may still borrow literals from the arena */
+    arena_free(&arena);
+    symtab_free();
     free(src);
 
     return 0;
-}
\ No newline at end of file
+}